@@ -0,0 +1,1131 @@
+// Copyright 2024 Christopher Bazley
+// SPDX-License-Identifier: MIT
+
+// Benchmarks for string buffer operations, printed in CSV format with one row per
+// benchmark and size: the mean time per operation, in nanoseconds, and the mean
+// number of bytes of memory consumed per operation (where measured).
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // for memmem
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+#include "strb.h"
+
+#if STRB_GAP
+#define CONFIG "gap"
+#elif STRB_SLAB
+#define CONFIG "slab"
+#elif STRB_NATIVE_FMT
+#define CONFIG "fmt"
+#elif STRB_LARGE
+#define CONFIG "large"
+#elif STRB_FREESTANDING
+#define CONFIG "freestanding"
+#elif STRB_STATIC_ALLOC
+#define CONFIG "static"
+#else
+#define CONFIG "dynamic"
+#endif
+
+/** Longest string used by benchmarks of appending and editing operations */
+#define MAX_LEN ((size_t)STRB_MAX_SIZE - 1 < 4096 ? (size_t)STRB_MAX_SIZE - 1 : 4096)
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *name, size_t size, double ns, size_t ops, size_t bytes)
+{
+    printf("%s,%s,%zu,%.2f,%.2f\n", name, CONFIG, size, ns / (double)ops,
+           (double)bytes / (double)ops);
+}
+
+static void fail(const char *what, size_t size)
+{
+    fprintf(stderr, "%s failed at size %zu\n", what, size);
+    exit(EXIT_FAILURE);
+}
+
+#if STRB_FREESTANDING
+static strbstate_t state;
+static char array[STRB_MAX_SIZE];
+#endif
+
+// Create an empty string buffer with room for at least n characters.
+// In freestanding builds, only one can exist at a time.
+static strb_t *new_string(size_t n)
+{
+#if STRB_FREESTANDING
+    (void)n;
+    return strb_use(&state, sizeof array, array);
+#else
+    _Optional strb_t *s = strb_alloc(n);
+    if (!s)
+        fail("Allocation", n);
+    return s;
+#endif
+}
+
+static void free_string(strb_t *s)
+{
+#if STRB_FREESTANDING
+    (void)s;
+#else
+    strb_free(s);
+#endif
+}
+
+// Create a string buffer containing a string of a given length
+static strb_t *new_filled(size_t len)
+{
+    strb_t *s = new_string(len);
+    if (strb_nputc(s, 'x', len) == EOF)
+        fail("Fill", len);
+    return s;
+}
+
+// Repeatedly insert one character at the start of a string of a given length
+static void bench_insert(size_t len, size_t ops)
+{
+    const size_t room = (size_t)STRB_MAX_SIZE - 1 - len,
+                 round = room < 1000 ? room : 1000;
+    strb_t *s = new_filled(len + round);
+    double t = 0;
+    size_t i, done;
+
+    strb_delto(s, len);
+    for (done = 0; done < ops; done += round) {
+        double start = now_ns();
+        for (i = 0; i < round; ++i) {
+            strb_seek(s, 0);
+            strb_putc(s, 'a');
+        }
+        t += now_ns() - start;
+
+        // Delete the inserted characters again
+        strb_seek(s, 0);
+        strb_delto(s, round);
+    }
+
+    if (strb_error(s) || strb_len(s) != len)
+        fail("Insert", len);
+
+    report("insert", len, t, done, 0);
+    free_string(s);
+}
+
+// Repeatedly insert several tokens at the start of a string of a given length,
+// either one at a time or in a single batch
+static void bench_insert_tokens(size_t len, size_t ops, bool batch)
+{
+    static const char *const tokens[] = {"if", "(", "x", ")", "return", " ", "0", ";"};
+    const size_t ntokens = sizeof tokens / sizeof tokens[0], tokens_len = 14;
+    const size_t room = (size_t)STRB_MAX_SIZE - 1 - len,
+                 round = room / tokens_len < 100 ? room / tokens_len : 100;
+    strb_t *s = new_filled(len + round * tokens_len);
+    double t = 0;
+    size_t i, j, done;
+
+    strb_delto(s, len);
+    for (done = 0; done < ops; done += round) {
+        double start = now_ns();
+        for (i = 0; i < round; ++i) {
+            strb_seek(s, 0);
+            if (batch) {
+                strb_putsv(s, tokens, ntokens);
+            } else {
+                for (j = 0; j < ntokens; ++j)
+                    strb_puts(s, tokens[j]);
+            }
+        }
+        t += now_ns() - start;
+
+        // Delete the inserted characters again
+        strb_seek(s, 0);
+        strb_delto(s, round * tokens_len);
+    }
+
+    if (strb_error(s) || strb_len(s) != len)
+        fail("Insert tokens", len);
+
+    report(batch ? "insert_putsv" : "insert_puts", len, t, done, 0);
+    free_string(s);
+}
+
+// Repeatedly overwrite part of a string of a given length
+static void bench_overwrite(size_t len, size_t ops)
+{
+    static const char token[] = "0123456789abcdef";
+    const size_t toklen = sizeof token - 1;
+    strb_t *s = new_filled(len);
+    double t;
+    size_t i;
+
+    strb_setmode(s, strb_overwrite);
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strb_seek(s, (i * 7) % (len - toklen + 1));
+        strb_puts(s, token);
+    }
+    t = now_ns() - t;
+
+    if (strb_error(s) || strb_len(s) != len)
+        fail("Overwrite", len);
+
+    report("overwrite", len, t, ops, 0);
+    free_string(s);
+}
+
+// Repeatedly put a character beyond the end of a string of a given length, then
+// truncate the string to its original length
+static void bench_seek_beyond(size_t len, size_t ops)
+{
+    strb_t *s = new_filled(len);
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strb_seek(s, len + 16);
+        strb_putc(s, 'z');
+        strb_seek(s, len);
+        strb_delto(s, SIZE_MAX);
+    }
+    t = now_ns() - t;
+
+    if (strb_error(s) || strb_len(s) != len)
+        fail("Seek beyond end", len);
+
+    report("seek_beyond", len, t, ops, 0);
+    free_string(s);
+}
+
+// Repeatedly delete one character from the middle of a string of between
+// len and twice len characters
+static void bench_delete(size_t len, size_t ops)
+{
+    strb_t *s = new_filled(len * 2);
+    double t = 0;
+    size_t i, done;
+
+    for (done = 0; done < ops; done += len) {
+        double start;
+
+        strb_seek(s, len / 2);
+        start = now_ns();
+        for (i = 0; i < len; ++i)
+            strb_delto(s, len / 2 + 1);
+        t += now_ns() - start;
+
+        // Restore the deleted characters
+        strb_seek(s, len);
+        strb_nputc(s, 'x', len);
+    }
+
+    if (strb_error(s) || strb_len(s) != len * 2)
+        fail("Delete", len);
+
+    report("delete", len, t, done, 0);
+    free_string(s);
+}
+
+// Repeatedly put a character at the end of a string of a given length, then
+// remove it again
+static void bench_unputc(size_t len, size_t ops)
+{
+    strb_t *s = new_filled(len);
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strb_putc(s, 'u');
+        strb_unputc(s);
+    }
+    t = now_ns() - t;
+
+    if (strb_error(s) || strb_len(s) != len)
+        fail("Unputc", len);
+
+    report("putc_unputc", len, t, ops, 0);
+    free_string(s);
+}
+
+// Append one character at a time, as a tokenizer would
+static void bench_putc(size_t ops)
+{
+    strb_t *s = new_string(MAX_LEN);
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        if (strb_len(s) == MAX_LEN)
+            strb_delto(s, 0);
+        strb_putc(s, 'a' + (int)(i % 26));
+    }
+    t = now_ns() - t;
+
+    if (strb_error(s))
+        fail("Putc", MAX_LEN);
+
+    report("putc", ops, t, ops, 0);
+    free_string(s);
+}
+
+// Append a short token at a time
+static void bench_puts(size_t ops)
+{
+    static const char *const tokens[] = {"if", "(", "x", ")", "return", " ", "0", ";"};
+    const size_t ntokens = sizeof tokens / sizeof tokens[0];
+    strb_t *s = new_string(MAX_LEN);
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        if (strb_len(s) >= MAX_LEN - 8)
+            strb_delto(s, 0);
+        strb_puts(s, tokens[i % ntokens]);
+    }
+    t = now_ns() - t;
+
+    if (strb_error(s))
+        fail("Puts", MAX_LEN);
+
+    report("puts", ops, t, ops, 0);
+    free_string(s);
+}
+
+// Append a block of characters at a time by writing them directly
+static void bench_write(size_t ops)
+{
+    static const char block[] = "0123456789abcdef";
+    const size_t n = sizeof block - 1;
+    strb_t *s = new_string(MAX_LEN);
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        _Optional char *buf;
+
+        if (strb_len(s) > MAX_LEN - n)
+            strb_delto(s, 0);
+        buf = strb_write(s, n);
+        if (buf)
+            memcpy(buf, block, n);
+    }
+    t = now_ns() - t;
+
+    if (strb_error(s))
+        fail("Write", MAX_LEN);
+
+    report("write", n, t, ops, 0);
+    free_string(s);
+}
+
+// Wrap an existing string of a given length
+static void bench_reuse(size_t len, size_t ops)
+{
+    static char buf[((size_t)1 << 16) + 1];
+    strbstate_t sbs;
+    size_t i, total = 0;
+    double t;
+
+    memset(buf, 'r', len);
+    buf[len] = '\0';
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        _Optional strb_t *s = strb_reuse(&sbs, sizeof buf, buf);
+        if (!s)
+            fail("Reuse", len);
+        total += strb_len(s);
+    }
+    t = now_ns() - t;
+
+    if (total != len * ops)
+        fail("Reuse", len);
+
+    report("reuse", len, t, ops, 0);
+}
+
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
+// Append a typical log line
+static void bench_putf(size_t ops)
+{
+    strb_t *s = new_string(0);
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strb_delto(s, 0);
+        strb_putf(s, "%s:%d: request %zu took %uus (%x)", "bench.c", __LINE__, i, 1234u, 0xbeefu);
+    }
+    t = now_ns() - t;
+
+    if (strb_error(s))
+        fail("Formatting", 0);
+
+    report("putf", ops, t, ops, 0);
+    free_string(s);
+}
+
+// Replace a string with a short formatted one
+static void bench_printf(size_t ops)
+{
+    strb_t *s = new_string(0);
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i)
+        strb_printf(s, "%d/%d", (int)(i % 1000), 1000);
+    t = now_ns() - t;
+
+    if (strb_error(s))
+        fail("Printing", 0);
+
+    report("printf", ops, t, ops, 0);
+    free_string(s);
+}
+#endif
+
+// Repeatedly create a string buffer, put a character in it and destroy it
+static void bench_alloc(size_t n, size_t ops)
+{
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strb_t *s = new_string(n);
+        strb_putc(s, 'a');
+        free_string(s);
+    }
+    t = now_ns() - t;
+
+    report("alloc_free", n, t, ops, 0);
+}
+
+#if STRB_LARGE
+// Grow a string to a given size by appending blocks of characters
+static void bench_grow(size_t size)
+{
+    const size_t block = (size_t)1 << 16;
+    strb_t *s = new_string(0);
+    double t;
+    size_t i;
+
+    t = now_ns();
+    for (i = 0; i < size; i += block)
+        strb_nputc(s, 'g', block);
+    t = now_ns() - t;
+
+    if (strb_error(s) || strb_len(s) != i)
+        fail("Growth", size);
+
+    report("grow", size, t, size / block, 0);
+    free_string(s);
+}
+#endif
+
+enum { FIND_STRB, FIND_STRSTR, FIND_MEMMEM };
+
+// Find the last characters of a long string of text, by searching from the start
+static void bench_find(size_t hay_len, size_t len, size_t ops, int how)
+{
+    static const char *const names[] = {"find_strb", "find_strstr", "find_memmem"};
+    strb_t *s = new_string(hay_len);
+    unsigned int seed = 1;
+    _Optional const char *found = NULL;
+    size_t i;
+    double t;
+
+    for (i = 0; i < hay_len; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        if (strb_putc(s, "etaoin shrdlucmfwyp"[(seed >> 16) % 19]) == EOF)
+            fail("Fill", hay_len);
+    }
+    {
+        char needle[64 + 1];
+        const char *hay = strb_cptr(s); // not moved by strb_seek or strb_find
+
+        memcpy(needle, hay + hay_len - len, len);
+        needle[len] = '\0';
+
+        t = now_ns();
+        for (i = 0; i < ops; ++i) {
+            switch (how) {
+            case FIND_STRB:
+                found = strb_seek(s, 0) || strb_find(s, needle, len) ? NULL : hay + strb_tell(s);
+                break;
+            case FIND_STRSTR:
+                found = strstr(hay, needle);
+                break;
+#ifdef __GLIBC__
+            case FIND_MEMMEM:
+                found = memmem(hay, hay_len, needle, len);
+                break;
+#endif
+            }
+            if (found != hay + hay_len - len && !(found && !memcmp(found, needle, len)))
+                fail("Find", len);
+        }
+        t = now_ns() - t;
+    }
+
+    report(names[how], len, t, ops, 0);
+    free_string(s);
+}
+
+// Replace every occurrence of a word
+static size_t replace(strb_t *s, const char *from, const char *to, bool loop)
+{
+    size_t count = 0;
+
+    if (strb_seek(s, 0))
+        fail("Seek", 0);
+
+    if (!loop)
+        return strb_replace_all(s, from, to);
+
+    while (!strb_seekstr(s, from)) {
+        strb_delto(s, strb_tell(s) + strlen(from));
+        if (strb_puts(s, to))
+            fail("Puts", count);
+        ++count;
+    }
+    return count;
+}
+
+// Replace words with longer ones and back again, either all at once or one at a time
+static void bench_replace(size_t len, size_t ops, bool loop)
+{
+    strb_t *s = new_string(len * 4 / 3);
+    size_t i;
+    double t;
+
+    for (i = 0; i + 3 <= len; i += 3) {
+        if (strb_puts(s, "ab "))
+            fail("Fill", len);
+    }
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        if (replace(s, "ab", "xyz", loop) != len / 3 || replace(s, "xyz", "ab", loop) != len / 3)
+            fail("Replace", len);
+    }
+    t = now_ns() - t;
+
+    report(loop ? "replace_loop" : "replace_all", len, t, ops, 0);
+    free_string(s);
+}
+
+#if STRB_RESTORE
+enum { TOK_VIEW, TOK_SPLIT, TOK_STRTOK };
+
+// Split a line into fields of a given length, either in place or by copying the line for strtok_r
+static void bench_tok(size_t field_len, size_t ops, int how)
+{
+    static const char *const names[] = {"tok_view", "tok_split", "tok_strtok"};
+    static char copy[MAX_LEN + 1];
+    strb_t *s = new_string(MAX_LEN);
+    size_t i, j, expect = 0, total = 0;
+    double t;
+
+    for (i = 0; i + field_len + 2 <= MAX_LEN; i += field_len + 2) {
+        for (j = 0; j < field_len; ++j) {
+            if (strb_putc(s, 'a' + (int)(j % 26)) == EOF)
+                fail("Fill", field_len);
+        }
+        if (strb_puts(s, i % 3 ? ", " : ",\t"))
+            fail("Fill", field_len);
+        expect += field_len;
+    }
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        if (how == TOK_STRTOK) {
+            _Optional char *save = NULL, *field;
+
+            strcpy(copy, strb_cptr(s));
+            for (field = strtok_r(copy, ", \t", &save); field; field = strtok_r(NULL, ", \t", &save))
+                total += strlen(field);
+        } else {
+            strb_tok_t it;
+
+            if (strb_seek(s, 0))
+                fail("Seek", 0);
+
+            strb_tok_init(&it, how == TOK_SPLIT);
+            while (!strb_tok_next(s, &it, ", \t"))
+                total += how == TOK_SPLIT ? strlen(it.ptr) : it.len;
+        }
+    }
+    t = now_ns() - t;
+
+    if (total != expect * ops)
+        fail("Tokenize", field_len);
+
+    report(names[how], field_len, t, ops, 0);
+    free_string(s);
+}
+#endif
+
+#if STRB_LINES
+enum { LINES_SEEK, LINES_SCAN, LINES_BUILD };
+
+// Seek to random lines of a document, either with the index of lines or by scanning from the
+// start, or rebuild the index after changing the first character
+static void bench_lines(size_t len, size_t ops, int how)
+{
+    static const char *const names[] = {"lines_seek", "lines_scan", "lines_build"};
+    strb_t *s = new_string(len);
+    unsigned int seed = 1;
+    size_t i, nlines = 1;
+    double t;
+
+    for (i = 0; i < len; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        if (strb_putc(s, (seed >> 16) % 40 ? 'a' + (int)(i % 26) : '\n') == EOF)
+            fail("Fill", len);
+        nlines += strb_cptr(s)[i] == '\n';
+    }
+    if (strb_lineof(s, len) != nlines - 1)
+        fail("Index", len);
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        const size_t line = (seed = seed * 1103515245u + 12345u) % nlines;
+        _Optional const char *p = strb_cptr(s), *const end = p + len;
+        size_t j;
+
+        switch (how) {
+        case LINES_SEEK:
+            if (strb_seekline(s, line))
+                fail("Seek", line);
+            break;
+        case LINES_SCAN:
+            for (j = 0; j < line && p; ++j) {
+                p = memchr(p, '\n', (size_t)(end - p));
+                if (p)
+                    ++p;
+            }
+            if (!p || strb_seek(s, (size_t)(p - strb_cptr(s))))
+                fail("Scan", line);
+            break;
+        case LINES_BUILD:
+            strb_ptr(s)[0] = 'a'; // forget the index
+            if (strb_lineof(s, len) != nlines - 1)
+                fail("Index", len);
+            break;
+        }
+    }
+    t = now_ns() - t;
+
+    report(names[how], len, t, ops, 0);
+    free_string(s);
+}
+#endif
+
+#if STRB_HASH
+#define HASH_KEYS 64
+
+// Look up keys in a hash table, either using the cached hash of each key or
+// discarding the cache (by calling strb_ptr) to rehash the key every time
+static void bench_hash(size_t len, size_t ops, bool cached)
+{
+    static strbstate_t states[HASH_KEYS];
+    static char arrays[HASH_KEYS][MAX_LEN + 1];
+    strb_t *keys[HASH_KEYS];
+    const strb_t *slots[HASH_KEYS * 2] = {NULL};
+    const size_t mask = HASH_KEYS * 2 - 1;
+    size_t i, j;
+    double t;
+
+    for (i = 0; i < HASH_KEYS; ++i) {
+        keys[i] = strb_use(&states[i], sizeof arrays[i], arrays[i]);
+        if (strb_putc(keys[i], 'A' + (int)(i % 26)) == EOF ||
+            strb_putc(keys[i], 'a' + (int)(i / 26)) == EOF ||
+            strb_nputc(keys[i], 'x', len - 2) == EOF)
+            fail("Fill", len);
+
+        for (j = (size_t)strb_hash(keys[i]) & mask; slots[j]; j = (j + 1) & mask)
+            ;
+        slots[j] = keys[i];
+    }
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strb_t *const key = keys[i % HASH_KEYS];
+
+        if (!cached)
+            (void)strb_ptr(key);
+
+        for (j = (size_t)strb_hash(key) & mask; slots[j] != key; j = (j + 1) & mask) {
+            if (!slots[j])
+                fail("Look up", len);
+        }
+    }
+    t = now_ns() - t;
+
+    report(cached ? "hash_cached" : "hash_uncached", len, t, ops, 0);
+}
+#endif
+
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+// Peak resident set size, in bytes, or 0 if unknown
+static size_t peak_rss(void)
+{
+#ifdef __linux__
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage))
+        return (size_t)usage.ru_maxrss * 1024;
+#endif
+    return 0;
+}
+
+#if STRB_POSIX
+// Write a batch of short lines to the null device, one call per line or
+// gathered into as few calls as possible
+static void bench_write_fd(size_t ops, bool gather)
+{
+    enum { NLINES = 64 };
+    strb_t *lines[NLINES];
+    FILE *const f = fopen("/dev/null", "w");
+    size_t i, done;
+    double t;
+    int fd, err = 0;
+
+    if (!f)
+        fail("Open", 0);
+    fd = fileno(f);
+
+    for (i = 0; i < NLINES; ++i) {
+        lines[i] = new_string(0);
+        if (strb_printf(lines[i], "10.0.0.%zu - - \"GET /%zu HTTP/1.1\" 200\n", i, i))
+            fail("Line", i);
+    }
+
+    t = now_ns();
+    for (done = 0; done < ops; done += NLINES) {
+        if (gather) {
+            err |= strb_writev_fd(fd, lines, NLINES);
+        } else {
+            for (i = 0; i < NLINES; ++i)
+                err |= strb_write_fd(lines[i], fd);
+        }
+    }
+    t = now_ns() - t;
+
+    if (err)
+        fail("Write", NLINES);
+
+    report(gather ? "writev_fd" : "write_fd", NLINES, t, done, 0);
+    for (i = 0; i < NLINES; ++i)
+        free_string(lines[i]);
+    fclose(f);
+}
+
+// Repeatedly read a whole file of a given size into a new string, then
+// repeatedly map it instead
+static void bench_readfile(size_t size, size_t ops)
+{
+    char path[] = "/tmp/strbbenchXXXXXX";
+    const int fd = mkstemp(path);
+    FILE *const f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    size_t i;
+    double t;
+
+    if (!f)
+        fail("Create file", size);
+    for (i = 0; i < size; ++i)
+        fputc('a' + (int)(i % 26), f);
+    if (fclose(f))
+        fail("Write file", size);
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strb_t *s = new_string(0);
+        if (strb_readfile(s, path) || strb_len(s) != size)
+            fail("Read file", size);
+        free_string(s);
+    }
+    t = now_ns() - t;
+
+    report("readfile", size, t, ops, 0);
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strbstate_t state;
+        _Optional const strb_t *s = strb_map_file(&state, path);
+        if (!s || strb_len(s) != size)
+            fail("Map file", size);
+        strb_free((strb_t *)s);
+    }
+    t = now_ns() - t;
+
+    report("map_file", size, t, ops, 0);
+    remove(path);
+}
+#endif
+
+// Build strings of a given length and hand them over to code that frees them,
+// either by copying them or by detaching them from their string buffers
+static void bench_detach(size_t len, size_t ops, bool detach)
+{
+    size_t i;
+    double t;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        strb_t *s = new_filled(len);
+        _Optional char *str;
+
+        if (detach) {
+            str = strb_detach(s, NULL);
+        } else {
+            str = malloc(strb_len(s) + 1);
+            if (str)
+                memcpy(str, strb_cptr(s), strb_len(s) + 1);
+            strb_free(s);
+        }
+        if (!str)
+            fail("Hand over", len);
+        free(str);
+    }
+    t = now_ns() - t;
+
+    report(detach ? "detach" : "copy_free", len, t, ops, 0);
+}
+
+#define FANOUT 8
+
+// Hand copies of a string to several owners that only read them, either by
+// duplicating the string or by cloning the string buffer object
+static void bench_fanout(size_t len, size_t ops, bool clone)
+{
+    strb_t *s = new_filled(len);
+    _Optional strb_t *copies[FANOUT];
+    size_t i, j, sum = 0;
+    double t;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        for (j = 0; j < FANOUT; ++j) {
+            copies[j] = clone ? strb_clone(s) : strb_ndup(strb_cptr(s), len);
+            if (!copies[j])
+                fail("Copy", len);
+        }
+        for (j = 0; j < FANOUT; ++j) {
+            sum += (unsigned char)strb_cptr(copies[j])[len - 1];
+            strb_free(copies[j]);
+        }
+    }
+    t = now_ns() - t;
+
+    if (sum != ops * FANOUT * 'x')
+        fail("Read copies", len);
+
+    report(clone ? "fanout_clone" : "fanout_ndup", len, t, ops * FANOUT, 0);
+    free_string(s);
+}
+
+#if STRB_FOPEN
+// Build a string from lines printed to a stream, either through a memory stream
+// whose contents are then duplicated or through a stream that writes to the string
+static void bench_fopen(size_t nlines, size_t ops, bool direct)
+{
+    size_t i, j;
+    double t;
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        _Optional strb_t *s = NULL;
+        _Optional char *mem = NULL;
+        size_t mem_size;
+        _Optional FILE *f;
+
+        if (direct) {
+            s = new_string(0);
+            f = strb_fopen(s, "w");
+        } else {
+            f = open_memstream(&mem, &mem_size);
+        }
+        if (!f)
+            fail("Open stream", nlines);
+
+        for (j = 0; j < nlines; ++j)
+            fprintf(f, "10.0.0.%zu - - \"GET /%zu HTTP/1.1\" 200\n", j, i);
+
+        if (fclose(f))
+            fail("Close stream", nlines);
+
+        if (!direct) {
+            s = mem ? strb_dup(mem) : NULL;
+            free(mem);
+        }
+        if (!s || strb_error(s))
+            fail("Print to stream", nlines);
+
+        free_string(s);
+    }
+    t = now_ns() - t;
+
+    report(direct ? "strb_fopen" : "open_memstream_dup", nlines, t, ops, 0);
+}
+#endif
+
+#define MATCH_MAX 300
+
+static int count_match(_Optional void *arg, size_t pattern, size_t pos)
+{
+    size_t *const count = arg;
+    (void)pattern;
+    (void)pos;
+    ++*count;
+    return 0;
+}
+
+// Check a line of text for many tokens, either all at once or one at a time
+static void bench_match(size_t npatterns, size_t ops, bool automaton)
+{
+    static char tokens[MATCH_MAX][9];
+    const char *patterns[MATCH_MAX];
+    _Optional strbmatcher_t *m = NULL;
+    strb_t *s = new_string(MAX_LEN);
+    unsigned int seed = 1;
+    size_t i, j, count = 0, expect = 0;
+    double t;
+
+    for (i = 0; i < npatterns; ++i) {
+        for (j = 0; j < 8; ++j) {
+            seed = seed * 1103515245u + 12345u;
+            tokens[i][j] = "etaoin shrdlucmfwyp"[(seed >> 16) % 19];
+        }
+        tokens[i][8] = '\0';
+        patterns[i] = tokens[i];
+    }
+    for (i = 0; i < MAX_LEN; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        if (strb_putc(s, "etaoin shrdlucmfwyp"[(seed >> 16) % 19]) == EOF)
+            fail("Fill", MAX_LEN);
+    }
+    for (i = 0; i < 2; ++i) {
+        // Plant some tokens
+        if (strb_seek(s, MAX_LEN / 3 * (i + 1)) || strb_puts(s, tokens[i * npatterns / 2]))
+            fail("Plant", i);
+    }
+
+    if (automaton) {
+        m = strb_matcher_compile(patterns, npatterns);
+        if (!m)
+            fail("Compile", npatterns);
+    }
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        if (m) {
+            strb_match_all(s, m, count_match, &count);
+        } else {
+            for (j = 0; j < npatterns; ++j) {
+                const char *found;
+                for (found = strstr(strb_cptr(s), patterns[j]); found; found = strstr(found + 1, patterns[j]))
+                    ++count;
+            }
+        }
+        expect += 2;
+    }
+    t = now_ns() - t;
+
+    if (count < expect)
+        fail("Match", npatterns);
+
+    report(automaton ? "match_all" : "match_strstr", npatterns, t, ops, 0);
+    strb_matcher_free(m);
+    free_string(s);
+}
+
+// Duplicate many short strings, then free them all
+static void bench_dup(size_t ops)
+{
+    _Optional strb_t **s = malloc(ops * sizeof(*s));
+    char key[16];
+    size_t i, rss;
+    double t;
+
+    if (!s)
+        fail("Allocation", ops);
+
+    rss = peak_rss();
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        snprintf(key, sizeof key, "key%zu", i);
+        s[i] = strb_dup(key);
+        if (!s[i])
+            fail("Dup", i);
+    }
+    t = now_ns() - t;
+    rss = peak_rss() - rss;
+    report("dup", ops, t, ops, rss);
+
+    t = now_ns();
+    for (i = 0; i < ops; ++i)
+        strb_free(s[i]);
+    t = now_ns() - t;
+    report("free", ops, t, ops, 0);
+
+    free(s);
+}
+
+// Intern many short strings drawn from a small vocabulary, as a parser would
+static void bench_intern(size_t ops, size_t vocab)
+{
+    _Optional strbintern_t *table = strb_intern_alloc();
+    char key[16];
+    size_t i, rss;
+    double t;
+
+    if (!table)
+        fail("Allocation", ops);
+
+    rss = peak_rss();
+    t = now_ns();
+    for (i = 0; i < ops; ++i) {
+        const int len = snprintf(key, sizeof key, "key%zu", i % vocab);
+        if (len < 0 || !strb_intern(table, key, (size_t)len))
+            fail("Intern", i);
+    }
+    t = now_ns() - t;
+    rss = peak_rss() - rss;
+    report("intern", ops, t, ops, rss);
+
+    strb_intern_free(table);
+}
+#endif
+
+int main(void)
+{
+    size_t len;
+
+    puts("benchmark,config,size,ns_per_op,bytes_per_op");
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+    bench_dup(1000000); // needs more string buffer objects than STRB_MAX
+    bench_intern(1000000, 1000);
+    for (len = 10; len <= MATCH_MAX; len *= len < 100 ? 10 : 3) {
+        bench_match(len, 100000 / len, false);
+        bench_match(len, 100000 / len, true);
+    }
+    for (len = 16; len <= MAX_LEN; len *= 16) {
+        bench_detach(len, 1000000, false);
+        bench_detach(len, 1000000, true);
+    }
+    for (len = 16; len <= MAX_LEN; len *= 16) {
+        bench_fanout(len, 100000, false);
+        bench_fanout(len, 100000, true);
+    }
+#if STRB_FOPEN
+    for (len = 1; len <= 64; len *= 8) {
+        bench_fopen(len, 1000000 / len, false);
+        bench_fopen(len, 1000000 / len, true);
+    }
+#endif
+#if STRB_POSIX
+    bench_write_fd(1000000, false);
+    bench_write_fd(1000000, true);
+    for (len = 256; len < STRB_MAX_SIZE && len <= ((size_t)1 << 24); len *= 16)
+        bench_readfile(len, ((size_t)1 << 26) / len < 100000 ? ((size_t)1 << 26) / len : 100000);
+#endif
+#endif
+    for (len = 16; len <= MAX_LEN; len *= 16)
+        bench_alloc(len, 1000000);
+
+    {
+        // Search a 64 KiB string (or as long as a string can be)
+        const size_t hay_len = (size_t)STRB_MAX_SIZE - 1 < 65536 ? (size_t)STRB_MAX_SIZE - 1 : 65536;
+
+        for (len = 4; len <= 64; len *= 4) {
+            bench_find(hay_len, len, ((size_t)1 << 28) / hay_len, FIND_STRB);
+            bench_find(hay_len, len, ((size_t)1 << 28) / hay_len, FIND_STRSTR);
+#ifdef __GLIBC__
+            bench_find(hay_len, len, ((size_t)1 << 28) / hay_len, FIND_MEMMEM);
+#endif
+        }
+    }
+
+    for (len = 16; len * 4 / 3 <= MAX_LEN; len *= 4) {
+        bench_replace(len, 10000000 / len, true);
+        bench_replace(len, 10000000 / len, false);
+    }
+
+#if STRB_RESTORE
+    for (len = 4; len * 4 <= MAX_LEN; len *= 4) {
+        bench_tok(len, 100000, TOK_VIEW);
+        bench_tok(len, 100000, TOK_SPLIT);
+        bench_tok(len, 100000, TOK_STRTOK);
+    }
+#endif
+
+#if STRB_LINES
+    for (len = 4096; len < STRB_MAX_SIZE && len <= ((size_t)1 << 24); len *= 64) {
+        bench_lines(len, 1000000, LINES_SEEK);
+        bench_lines(len, ((size_t)1 << 28) / len, LINES_SCAN);
+        bench_lines(len, ((size_t)1 << 28) / len, LINES_BUILD);
+    }
+#endif
+
+#if STRB_HASH
+    for (len = 16; len <= MAX_LEN; len *= 16) {
+        bench_hash(len, 10000000, false);
+        bench_hash(len, 10000000, true);
+    }
+#endif
+
+    bench_putc(100000000);
+    bench_puts(10000000);
+    bench_write(10000000);
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
+    bench_putf(1000000);
+    bench_printf(1000000);
+#endif
+
+    for (len = 8; len < STRB_MAX_SIZE && len <= ((size_t)1 << 16); len *= 2)
+        bench_reuse(len, ((size_t)1 << 26) / len);
+
+    for (len = 16; len * 2 <= MAX_LEN; len *= 4) {
+        bench_overwrite(len, 1000000);
+        bench_delete(len, 1000000);
+        bench_unputc(len, 1000000);
+    }
+
+    for (len = 16; len + 17 <= MAX_LEN; len *= 4)
+        bench_seek_beyond(len, 1000000);
+
+    // Insertion cost depends on the length of the tail, so try longer strings
+    for (len = 16; len + 16 < STRB_MAX_SIZE && len <= ((size_t)1 << 24); len *= 4)
+        bench_insert(len, len < 65536 ? 1000000 : 1000);
+
+    for (len = 16; len + 14 < STRB_MAX_SIZE && len <= ((size_t)1 << 20); len *= 16) {
+        bench_insert_tokens(len, len < 65536 ? 1000000 : 1000, false);
+        bench_insert_tokens(len, len < 65536 ? 1000000 : 1000, true);
+    }
+
+#if STRB_LARGE
+    for (len = (size_t)1 << 22; len <= (size_t)1 << 28; len *= 4)
+        bench_grow(len);
+#endif
+
+    return 0;
+}
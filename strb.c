@@ -16,37 +16,64 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <wchar.h>
 #include <assert.h>
 
 #include "strb.h"
 
-#define _Optional
-
-#if STRB_UNPUTC
-#define F_CAN_UNPUTC (1<<0)
-#else
-#define F_CAN_UNPUTC 0
+#if STRB_MMAP || STRB_POSIX
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__) && !STRB_FREESTANDING
+// AVX2 kernels are compiled separately and chosen at run time
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+#if STRB_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+#define _Optional
 
+#define F_CAN_UNPUTC STRB_PRIVATE_CAN_UNPUTC
 #define F_ERR (1<<1)
+#define F_CAN_RESTORE STRB_PRIVATE_CAN_RESTORE
+#define F_OVERWRITE STRB_PRIVATE_OVERWRITE
+#define F_KIND (7<<4)
+#define F_IS_CONST STRB_PRIVATE_IS_CONST
 
-#if STRB_RESTORE
-#define F_CAN_RESTORE (1<<2)
-#else
-#define F_CAN_RESTORE 0
-#endif
+_Static_assert(!(F_KIND & (F_CAN_UNPUTC | F_ERR | F_CAN_RESTORE | F_OVERWRITE | F_IS_CONST)),
+               "Kind of buffer overlaps other flags");
 
-#define F_OVERWRITE (1<<3)
-#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
-#define F_ALLOCATED (1<<4)
-#endif
-#define F_EXTERNAL (1<<5)
-#define F_AUTOFREE (1<<6)
-#if STRB_REUSE_CONST
-#define F_IS_CONST (1<<7)
-#else
-#define F_IS_CONST 0
-#endif
+// Each string buffer object has exactly one kind, which says where its characters are
+// stored and who owns them and the object itself.
+#define KIND_INTERNAL (0<<4)   // internal buffer of an object allocated by this library
+#define KIND_ALLOCATED (1<<4)  // heap buffer owned by the object
+#define KIND_SHARED (2<<4)     // heap buffer shared by clones until one of them is modified
+#define KIND_USER (3<<4)       // caller's array, described by an allocated object
+#define KIND_USER_STATE (4<<4) // caller's array, described by the caller's state object
+#define KIND_MAPPED (5<<4)     // file mapped by strb_map_file, described by the caller's state
+#define KIND_INTERNED (6<<4)   // string and state owned by an intern table
+
+#define kind(sb) ((sb)->p.flags & F_KIND)
+#define set_kind(sb, k) ((sb)->p.flags = (char)(((sb)->p.flags & ~F_KIND) | (k)))
+
+// Whether a buffer belongs to someone other than the object, so it can't be replaced
+#define is_external(sb) (kind(sb) != KIND_INTERNAL && kind(sb) != KIND_ALLOCATED)
+
+// Whether strb_free frees the object, which otherwise belongs to the caller or an intern table
+#define frees_object(sb) \
+    (kind(sb) != KIND_USER_STATE && kind(sb) != KIND_MAPPED && kind(sb) != KIND_INTERNED)
+
+#define is_shared(sb) (kind(sb) == KIND_SHARED)
 
 /** String buffer object */
 struct strb_t {
@@ -58,18 +85,212 @@ struct strb_t {
     /** Internal string buffer */
     char internal[STRB_MAX_SIZE];
 #else
+#if STRB_SLAB
+    /** Index of the size class from which this object was allocated */
+    unsigned char size_class;
+#endif
     /** Internal string buffer */
     char internal[];
 #endif
 };
 
+_Static_assert(offsetof(struct strb_t, p) == 0, "State must be first for inline functions");
+
+#if STRB_STATS
+static strbstats_t totals;
+#define STAT_ADD(sb, field, n) ((sb)->p.stats.field += (n), totals.field += (n))
+#define STAT_INIT(p) memset(&(p)->stats, 0, sizeof((p)->stats))
+#else
+#define STAT_ADD(sb, field, n) ((void)0)
+#define STAT_INIT(p) ((void)0)
+#endif
+
+#if STRB_HASH
+// The hash of the first hashed characters is cached, where hashed is a multiple of the
+// word size. Forget it if a character before pos is changed.
+#define HASH_CHANGE(sb, pos) ((void)((pos) < (sb)->p.hashed && ((sb)->p.hashed = 0)))
+#define HASH_INIT(p) ((p)->hashed = 0)
+#else
+#define HASH_CHANGE(sb, pos) ((void)0)
+#define HASH_INIT(p) ((void)0)
+#endif
+
+#if STRB_LINES
+// The start of each line in the first indexed characters is recorded when needed.
+// Forget the lines that start after pos if the character at pos is changed.
+struct strblines_t {
+    strbsize_t indexed;  // number of characters indexed
+    size_t n, size;      // number of lines starting in the indexed characters, and room for more
+    strbsize_t starts[]; // position of the start of each line, beginning with 0
+};
+
+// Find the last line that starts at or before pos
+static size_t line_at(const struct strblines_t *lines, size_t pos)
+{
+    size_t lo = 0, hi = lines->n;
+
+    assert(lines->n > 0 && !lines->starts[0]);
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (lines->starts[mid] <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void truncate_lines(struct strblines_t *lines, strbsize_t pos)
+{
+    assert(pos < lines->indexed);
+    lines->n = line_at(lines, pos) + 1;
+    lines->indexed = pos;
+}
+
+#define LINES_CHANGE(sb, pos) ((void)((sb)->p.lines && (pos) < (sb)->p.lines->indexed && \
+                                      (truncate_lines((sb)->p.lines, (strbsize_t)(pos)), true)))
+#define LINES_INIT(p) ((p)->lines = NULL)
+#define LINES_FREE(sb) (free((sb)->p.lines), LINES_INIT(&(sb)->p))
+#else
+#define LINES_CHANGE(sb, pos) ((void)0)
+#define LINES_INIT(p) ((void)0)
+#define LINES_FREE(sb) ((void)0)
+#endif
+
+#if STRB_HASH || !STRB_FREESTANDING // also used for interning
+#define HASH_SEED UINT64_C(0x9e3779b97f4a7c15)
+#define HASH_MUL UINT64_C(0xff51afd7ed558ccd)
+
+// Mix whole 8-byte words of a string into a hash
+static uint64_t hash_words(uint64_t h, const char *s, size_t nwords)
+{
+    for (; nwords > 0; --nwords, s += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, s, sizeof w);
+        h = (h ^ w) * HASH_MUL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// Mix the last len % 8 characters of a string, and its length, into a hash
+static uint64_t hash_finish(uint64_t h, const char *tail, size_t len)
+{
+    uint64_t w = 0;
+
+    memcpy(&w, tail, len % sizeof w);
+    h = (h ^ w) * HASH_MUL;
+    h = (h ^ len) * HASH_MUL;
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    return h ^ (h >> 33);
+}
+#endif
+
+/** Size of the array used to generate formatted output that can't be generated in place */
+#define FMT_SCRATCH_SIZE (128)
+
 #if STRB_STATIC_ALLOC
 static strb_t bufs[STRB_MAX];
 static uint8_t nbufs, buf_map;
 #endif
 
+#define BYTES_ONE (UINT64_MAX / 0xff)
+#define BYTES_HIGH (BYTES_ONE << 7)
+
+// Get a mask of the bytes of x that are zero, without carries between bytes
+static uint64_t zero_bytes(uint64_t x)
+{
+    return ~(((x & ~BYTES_HIGH) + ~BYTES_HIGH) | x) & BYTES_HIGH;
+}
+
 #if STRB_STATIC_ALLOC || STRB_FREESTANDING
 // not provided by cc65
+#if defined(__GNUC__)
+// Whole aligned blocks are read, which never span a page boundary, even though
+// that means reading characters beyond the terminator or the limit.
+#define SCAN_UNCHECKED __attribute__((no_sanitize_address))
+#endif
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define SCAN_WIDTH 16 // bytes per block
+#define SCAN_BITS 1   // mask bits per byte
+
+SCAN_UNCHECKED static uint64_t zero_mask(const char *block)
+{
+    const __m128i v = _mm_load_si128((const __m128i *)(const void *)block);
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+}
+#elif defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && UINT64_MAX == UINTPTR_MAX
+#define SCAN_WIDTH 8
+#define SCAN_BITS 8
+
+typedef uint64_t __attribute__((may_alias)) scan_word_t;
+
+SCAN_UNCHECKED static uint64_t zero_mask(const char *block)
+{
+    return zero_bytes(*(const scan_word_t *)(const void *)block);
+}
+#endif
+
+#if HAVE_AVX2
+// Scan 32 aligned bytes at a time using AVX2 (see strnlen), given that n is non-zero
+__attribute__((target("avx2")))
+SCAN_UNCHECKED static size_t strnlen_avx2(const char *s, size_t n)
+{
+    const size_t skip = (uintptr_t)s % sizeof(__m256i);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t mask;
+    size_t len;
+
+    mask = (uint32_t)_mm256_movemask_epi8(
+               _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)(const void *)(s - skip)), zero)) >>
+           skip;
+    if (mask) {
+        len = (size_t)__builtin_ctz(mask);
+    } else {
+        for (len = sizeof(__m256i) - skip; len < n; len += sizeof(__m256i)) {
+            mask = (uint32_t)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)(const void *)(s + len)), zero));
+            if (mask) {
+                len += (size_t)__builtin_ctz(mask);
+                break;
+            }
+        }
+    }
+    return len < n ? len : n;
+}
+#endif
+
+#ifdef SCAN_WIDTH
+SCAN_UNCHECKED size_t strnlen(const char *s, size_t n)
+{
+    const size_t skip = (uintptr_t)s % SCAN_WIDTH;
+    uint64_t mask;
+    size_t len;
+
+    if (!n)
+        return 0; // s need not point to any readable character
+
+#if HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return strnlen_avx2(s, n);
+#endif
+    mask = zero_mask(s - skip) >> (skip * SCAN_BITS);
+    if (mask) {
+        len = (size_t)__builtin_ctzll(mask) / SCAN_BITS;
+    } else {
+        for (len = SCAN_WIDTH - skip; len < n; len += SCAN_WIDTH) {
+            mask = zero_mask(s + len);
+            if (mask) {
+                len += (size_t)__builtin_ctzll(mask) / SCAN_BITS;
+                break;
+            }
+        }
+    }
+    return len < n ? len : n;
+}
+#else
 size_t strnlen(const char *s, size_t n)
 {
     size_t p = 0;
@@ -77,7 +298,8 @@ size_t strnlen(const char *s, size_t n)
         p++;
     return p;
 }
-#endif
+#endif // SCAN_WIDTH
+#endif // STRB_STATIC_ALLOC || STRB_FREESTANDING
 
 #if STRB_STATIC_ALLOC
 static _Optional strb_t *alloc_metadata(void)
@@ -112,6 +334,74 @@ static void free_metadata(_Optional strb_t *sb)
     }
 }
 #elif !STRB_FREESTANDING
+// Round up an internal buffer size to the size of its class
+static strbsize_t internal_size(strbsize_t size)
+{
+    strbsize_t class_size = STRB_MIN_INTERNAL_SIZE;
+
+    assert(size <= STRB_MAX_INTERNAL_SIZE);
+    while (class_size < size)
+        class_size *= 2;
+
+    return class_size;
+}
+
+#if STRB_SLAB
+#define NUM_CLASSES (5)
+
+_Static_assert((STRB_MIN_INTERNAL_SIZE << (NUM_CLASSES - 1)) == STRB_MAX_INTERNAL_SIZE,
+               "Wrong number of size classes");
+
+// Free objects of each size class, linked through their first member.
+// Slabs are never returned to the system.
+static void *free_blocks[NUM_CLASSES];
+
+static _Optional strb_t *alloc_metadata(strbsize_t size)
+{
+    unsigned char size_class = 0;
+    size_t block_size;
+
+    size = internal_size(size);
+    while (((strbsize_t)STRB_MIN_INTERNAL_SIZE << size_class) < size)
+        ++size_class;
+
+    assert(size_class < NUM_CLASSES);
+    block_size = sizeof(strb_t) + (size * sizeof(((strb_t *)0)->internal[0]));
+
+    if (!free_blocks[size_class]) {
+        const size_t nblocks = STRB_SLAB_SIZE / block_size;
+        char *const slab = malloc(nblocks * block_size);
+        size_t i;
+
+        if (!slab) return NULL;
+        DEBUGF("New slab %p of %zu blocks of %zu bytes\n", (void *)slab, nblocks, block_size);
+
+        for (i = nblocks; i-- > 0; ) {
+            void *block = slab + (i * block_size);
+            *(void **)block = free_blocks[size_class];
+            free_blocks[size_class] = block;
+        }
+    }
+
+    {
+        strb_t *sb = free_blocks[size_class];
+        free_blocks[size_class] = *(void **)sb;
+        sb->size_class = size_class;
+        return sb;
+    }
+}
+
+static void free_metadata(_Optional strb_t *sb)
+{
+    if (sb)
+    {
+        const unsigned char size_class = sb->size_class;
+        assert(size_class < NUM_CLASSES);
+        *(void **)sb = free_blocks[size_class];
+        free_blocks[size_class] = sb;
+    }
+}
+#else
 static _Optional strb_t *alloc_metadata(strbsize_t size)
 {
     assert(size <= STRB_MAX_INTERNAL_SIZE);
@@ -122,6 +412,205 @@ static void free_metadata(_Optional strb_t *sb)
 {
     free(sb);
 }
+#endif // STRB_SLAB
+
+#if STRB_MMAP
+// Buffers of at least STRB_MMAP_THRESHOLD characters are mapped instead of
+// allocated from the heap, so that they can grow by remapping pages instead
+// of copying them. Whether a buffer is mapped is implied by its size.
+#define is_mapped(size) ((size) >= STRB_MMAP_THRESHOLD)
+
+// Round up the size of a mapped buffer to a whole number of pages
+static strbsize_t map_size(strbsize_t size)
+{
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE), rem = size % page;
+    return rem && page - rem <= STRB_MAX_SIZE - size ? size + (page - rem) : size;
+}
+
+static _Optional char *map_alloc(strbsize_t size)
+{
+    void *const buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+
+    DEBUGF("Mapped %" PRIstrbsize " bytes at %p\n", size, buf);
+    return buf;
+}
+#else
+#define is_mapped(size) false
+#define map_size(size) (size)
+#define map_alloc(size) NULL
+#endif
+
+// Allocate a separate buffer of at least *size characters, which is updated
+static _Optional char *buf_alloc(strbsize_t *size)
+{
+    if (is_mapped(*size)) {
+        *size = map_size(*size);
+        return map_alloc(*size);
+    }
+    return malloc(*size * sizeof(char));
+}
+
+// Free a buffer allocated by buf_alloc or buf_realloc
+static void buf_free(char *buf, strbsize_t size)
+{
+#if STRB_MMAP
+    if (is_mapped(size)) {
+        munmap(buf, size);
+        return;
+    }
+#else
+    (void)size;
+#endif
+    free(buf);
+}
+
+// Reallocate a buffer, preserving its first used characters. The new size must be
+// at least used characters. Updates *new_size unless allocation fails, in which
+// case the old buffer is unchanged.
+static _Optional char *buf_realloc(char *buf, strbsize_t old_size, strbsize_t *new_size,
+                                   strbsize_t used)
+{
+    strbsize_t size = *new_size;
+    _Optional char *new_buf = NULL;
+
+    assert(used <= size);
+    assert(used <= old_size);
+
+    if (is_mapped(size))
+        size = map_size(size);
+
+    if (is_mapped(size) == is_mapped(old_size)) {
+#if STRB_MMAP
+        if (is_mapped(size)) {
+            void *const p = mremap(buf, old_size, size, MREMAP_MAYMOVE);
+            DEBUGF("Remapped %" PRIstrbsize " bytes at %p\n", size, p);
+            new_buf = p == MAP_FAILED ? NULL : p;
+        } else
+#endif
+        new_buf = realloc(buf, size * sizeof(char));
+    } else {
+        // Crossing the threshold in either direction requires a copy
+        new_buf = buf_alloc(&size);
+        if (new_buf) {
+            memcpy(new_buf, buf, used);
+            buf_free(buf, old_size);
+        }
+    }
+
+    if (new_buf)
+        *new_size = size;
+
+    return new_buf;
+}
+
+// The size of a buffer shared by strb_clone is understated as just enough for the
+// string, so that nothing is appended in place. Its actual size and the number of
+// string buffer objects sharing it are stored after the string, which doesn't change
+// while the buffer is shared.
+
+typedef struct {
+    size_t refs;     // number of string buffer objects sharing the buffer
+    strbsize_t size; // actual size of the buffer
+} shared_t;
+
+static size_t shared_offset(strbsize_t len)
+{
+    const size_t align = _Alignof(shared_t);
+    return ((size_t)len + 1 + align - 1) / align * align;
+}
+
+#define shared_hdr(sb) ((shared_t *)(void *)((sb)->p.buf + shared_offset((sb)->p.len)))
+
+// Start sharing an allocated buffer, enlarging it if there is no room for the
+// share count after the string
+static bool share(strb_t *sb)
+{
+    const size_t need = shared_offset(sb->p.len) + sizeof(shared_t);
+    shared_t *hdr;
+
+    assert(kind(sb) == KIND_ALLOCATED);
+
+    if (need > sb->p.size) {
+        strbsize_t new_size;
+        _Optional char *new_buf;
+
+        if (need > STRB_MAX_SIZE)
+            return false;
+
+        new_size = (strbsize_t)need;
+        new_buf = buf_realloc(sb->p.buf, sb->p.size, &new_size, sb->p.len + 1);
+        if (!new_buf)
+            return false;
+
+        sb->p.buf = new_buf;
+        sb->p.size = new_size;
+        STAT_ADD(sb, reallocs, 1);
+    }
+
+    hdr = shared_hdr(sb);
+    hdr->refs = 1;
+    hdr->size = sb->p.size;
+    sb->p.size = sb->p.len + 1;
+    set_kind(sb, KIND_SHARED);
+    DEBUGF("Sharing buffer %p of %" PRIstrbsize " bytes\n", (void *)sb->p.buf, hdr->size);
+    return true;
+}
+
+// Stop sharing a buffer, freeing it if no other object shares it
+static void release_shared(strb_t *sb)
+{
+    shared_t *const hdr = shared_hdr(sb);
+
+    assert(is_shared(sb));
+    assert(hdr->refs > 0);
+    if (!--hdr->refs) {
+        DEBUGF("Freeing shared buffer %p\n", (void *)sb->p.buf);
+        buf_free(sb->p.buf, hdr->size);
+    }
+}
+
+// Get a private copy of a shared buffer, preserving its first keep characters.
+// The last object to share a buffer takes it back instead of copying it.
+static bool make_private(strb_t *sb, strbsize_t keep)
+{
+    shared_t *const hdr = shared_hdr(sb);
+
+    assert(is_shared(sb));
+    assert(keep <= sb->p.len + 1);
+
+    if (hdr->refs == 1) {
+        DEBUGF("Reclaiming shared buffer %p\n", (void *)sb->p.buf);
+        sb->p.size = hdr->size;
+    } else {
+        strbsize_t size = hdr->size;
+        _Optional char *const buf = buf_alloc(&size);
+
+        if (!buf) {
+            DEBUGF("Can't copy shared buffer\n");
+            sb->p.flags |= F_ERR;
+            return false;
+        }
+
+        memcpy(buf, sb->p.buf, keep);
+        --hdr->refs;
+        sb->p.buf = buf;
+        sb->p.size = size;
+        STAT_ADD(sb, reallocs, 1);
+        DEBUGF("Copied shared buffer to %p\n", (void *)buf);
+    }
+    set_kind(sb, KIND_ALLOCATED);
+    return true;
+}
+
+// Ensure that a buffer can be modified, preserving its first keep characters
+#define unshare(sb, keep) (!is_shared(sb) || make_private(sb, keep))
+#endif
+
+#if STRB_STATIC_ALLOC || STRB_FREESTANDING
+#define unshare(sb, keep) true
 #endif
 
 #if STRB_EXT_STATE
@@ -130,7 +619,13 @@ static strb_t *init_use(strbstate_t *restrict sbs, strbsize_t size, char buf[STR
     sbs->p.len = sbs->p.pos = len;
     sbs->p.size = size;
     sbs->p.buf = buf;
-    sbs->p.flags = F_EXTERNAL | F_AUTOFREE;
+    sbs->p.flags = KIND_USER_STATE;
+#if STRB_GAP
+    sbs->p.gap_pos = sbs->p.gap_len = 0;
+#endif
+    STAT_INIT(&sbs->p);
+    HASH_INIT(&sbs->p);
+    LINES_INIT(&sbs->p);
 
 #if STRB_UNPUTC
     if (len)
@@ -198,6 +693,56 @@ _Optional const strb_t *strb_reuse_const(strbstate_t *restrict sbs, const char b
         return sb;
     }
 }
+
+#if STRB_POSIX
+_Optional const strb_t *strb_map_file(strbstate_t *restrict sbs, const char *path)
+{
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    _Optional const strb_t *sb = NULL;
+    struct stat st;
+    int fd;
+
+    assert(sbs);
+    assert(path);
+    DEBUGF("Map file %s\n", path);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        DEBUGF("Can't open %s\n", path);
+        return NULL;
+    }
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size >= 0 &&
+        (uintmax_t)st.st_size < STRB_MAX_SIZE - 1 && (uintmax_t)st.st_size < SIZE_MAX - page) {
+        const size_t len = (size_t)st.st_size;
+        // Reserve zero-filled pages for the whole file plus a terminator, then map the
+        // file over them, so that a terminator follows a file that fills its last page
+        const size_t map_size = (len + page) & ~(page - 1);
+        char *buf = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (buf == MAP_FAILED) {
+            DEBUGF("Can't reserve %zu bytes\n", map_size);
+        } else if (len && mmap(buf, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            DEBUGF("Can't map %s\n", path);
+            munmap(buf, map_size);
+        } else {
+            strb_t *const msb = init_use(sbs, len + 1, buf, len);
+            set_kind(msb, KIND_MAPPED);
+#ifndef NDEBUG
+            msb->p.flags |= F_IS_CONST;
+#endif
+            assert(!buf[len]);
+            DEBUGF("Mapped %zu bytes at %p\n", len, (void *)buf);
+            sb = msb;
+        }
+    } else {
+        DEBUGF("Can't map %s of unknown or excessive size\n", path);
+    }
+
+    close(fd);
+    return sb;
+}
+#endif // STRB_POSIX
 #endif // STRB_REUSE_CONST
 #endif // STRB_EXT_STATE
 
@@ -219,7 +764,13 @@ _Optional strb_t *strb_use(size_t size, char buf[STRB_SIZE_HINT(size)])
         sb->p.len = sb->p.pos = 0;
         sb->p.size = size;
         sb->p.buf = buf;
-        sb->p.flags = F_EXTERNAL;
+        sb->p.flags = KIND_USER;
+#if STRB_GAP
+        sb->p.gap_pos = sb->p.gap_len = 0;
+#endif
+        STAT_INIT(&sb->p);
+        HASH_INIT(&sb->p);
+        LINES_INIT(&sb->p);
         buf[0] = '\0';
         return sb;
     }
@@ -250,7 +801,13 @@ _Optional strb_t *strb_reuse(size_t size, char buf[STRB_SIZE_HINT(size)])
         sb->p.len = sb->p.pos = len;
         sb->p.size = size;
         sb->p.buf = buf;
-        sb->p.flags = F_EXTERNAL;
+        sb->p.flags = KIND_USER;
+#if STRB_GAP
+        sb->p.gap_pos = sb->p.gap_len = 0;
+#endif
+        STAT_INIT(&sb->p);
+        HASH_INIT(&sb->p);
+        LINES_INIT(&sb->p);
 
 #if STRB_UNPUTC
         if (len)
@@ -268,12 +825,15 @@ _Optional strb_t *strb_alloc(size_t n)
 #if STRB_STATIC_ALLOC
     n = STRB_MAX_SIZE;
 #else
-    if (n < STRB_DFL_SIZE)
+    if (n == 0)
         n = STRB_DFL_SIZE;
     else if (n >= STRB_MAX_SIZE)
         n = STRB_MAX_SIZE;
     else
         ++n; // allow space for a null terminator
+
+    if (n <= STRB_MAX_INTERNAL_SIZE)
+        n = internal_size(n); // the rest of the size class would be wasted
 #endif
     {
         // Don't allocate huge internal strings because the storage can't be recovered
@@ -282,23 +842,31 @@ _Optional strb_t *strb_alloc(size_t n)
         if (!sb) return NULL;
 #if !STRB_STATIC_ALLOC
         if (n > STRB_MAX_INTERNAL_SIZE) {
+            strbsize_t size = (strbsize_t)n;
             DEBUGF("Oversize buffer of %zu characters\n", n);
-            sb->p.buf = malloc(n * sizeof(*sb->p.buf));
+            sb->p.buf = buf_alloc(&size);
+            n = size;
             if (!sb->p.buf) {
                 free_metadata(sb);
                 return NULL;
             }
-            sb->p.flags = F_ALLOCATED;
+            sb->p.flags = KIND_ALLOCATED;
         } else
 #endif
         {
             DEBUGF("Internal buffer of %zu characters\n", n);
             sb->p.buf = sb->internal;
-            sb->p.flags = 0;
+            sb->p.flags = KIND_INTERNAL;
         }
 
         sb->p.len = sb->p.pos = 0;
         sb->p.size = n;
+#if STRB_GAP
+        sb->p.gap_pos = sb->p.gap_len = 0;
+#endif
+        STAT_INIT(&sb->p);
+        HASH_INIT(&sb->p);
+        LINES_INIT(&sb->p);
         sb->p.buf[0] = '\0';
         return sb;
     }
@@ -329,30 +897,35 @@ _Optional strb_t *strb_ndup(const char *str, size_t n)
 
 _Optional strb_t *strb_vaprintf(const char *restrict format, va_list args)
 {
+    char scratch[FMT_SCRATCH_SIZE];
+    _Optional strb_t *sb = NULL;
     va_list args_copy;
-    va_copy(args_copy, args);
-    {
-        strb_t *sb = NULL;
-        int len = vsnprintf(NULL, 0, format, args);
-        if (len < 0 || (size_t)len >= STRB_MAX_SIZE)
-            return NULL; // formatting failed or result too long
+    int len;
 
+    va_copy(args_copy, args);
+    len = vsnprintf(scratch, sizeof scratch, format, args);
+    if (len >= 0 && (size_t)len < STRB_MAX_SIZE) {
         sb = strb_alloc((size_t)len + 1);
-        if (!sb)
-                return NULL;
-
-        assert(sb->p.size > len);
-        vsprintf(sb->p.buf, format, args_copy);
-        va_end(args_copy);
+        if (sb) {
+            assert(sb->p.size > (size_t)len);
+            STAT_ADD(sb, formats, 1);
+            if ((size_t)len < sizeof scratch) {
+                memcpy(sb->p.buf, scratch, (size_t)len + 1);
+            } else {
+                vsprintf(sb->p.buf, format, args_copy); // scratch output was truncated
+                STAT_ADD(sb, formats, 1);
+            }
 
-        sb->p.len = sb->p.pos = (strbsize_t)len;
+            sb->p.len = sb->p.pos = (strbsize_t)len;
 #if STRB_UNPUTC
-        assert(!(sb->p.flags & F_OVERWRITE)); // needn't set unputc_char
-        if (len)
-            sb->p.flags |= F_CAN_UNPUTC;
+            assert(!(sb->p.flags & F_OVERWRITE)); // needn't set unputc_char
+            if (len)
+                sb->p.flags |= F_CAN_UNPUTC;
 #endif
-        return sb;
+        }
     }
+    va_end(args_copy);
+    return sb;
 }
 
 _Optional strb_t *strb_dup(const char *str)
@@ -377,37 +950,181 @@ void strb_free(_Optional strb_t *sb)
     if (!sb)
         return;
 
-    if (sb->p.flags & F_AUTOFREE)
+    LINES_FREE(sb);
+#if STRB_EXT_STATE && STRB_POSIX
+    if (kind(sb) == KIND_MAPPED) {
+        DEBUGF("Unmap file of %" PRIstrbsize " bytes at %p\n", sb->p.len, (void *)sb->p.buf);
+        munmap(sb->p.buf, sb->p.size);
+        return;
+    }
+#endif
+
+    if (!frees_object(sb))
         return;
 
 #if !STRB_STATIC_ALLOC
-    if (sb->p.flags & F_ALLOCATED)
-        free(sb->p.buf);
+    if (is_shared(sb))
+        release_shared(sb);
+    else if (kind(sb) == KIND_ALLOCATED)
+        buf_free(sb->p.buf, sb->p.size);
 #endif
 
     free_metadata(sb);
 }
+
 #endif // !STRB_FREESTANDING
 
+#if STRB_GAP
+// The gap is a run of unused characters at gap_pos, between the characters
+// before and after that position. It is only ever opened in an internal
+// buffer, because the contents of an external array must always be visible.
+static void move_gap(strb_t *sb, strbsize_t pos)
+{
+    char *const buf = sb->p.buf;
+    const strbsize_t gap_pos = sb->p.gap_pos, gap_len = sb->p.gap_len;
+
+    assert(pos <= sb->p.len);
+    if (pos < gap_pos) {
+        DEBUGF("Moving gap down from %" PRIstrbsize " to %" PRIstrbsize "\n", gap_pos, pos);
+        memmove(buf + pos + gap_len, buf + pos, gap_pos - pos);
+        STAT_ADD(sb, moved, gap_pos - pos);
+    } else if (pos > gap_pos) {
+        DEBUGF("Moving gap up from %" PRIstrbsize " to %" PRIstrbsize "\n", gap_pos, pos);
+        memmove(buf + gap_pos, buf + gap_pos + gap_len, pos - gap_pos);
+        STAT_ADD(sb, moved, pos - gap_pos);
+    }
+    sb->p.gap_pos = pos;
+}
+
+static void close_gap(strb_t *sb)
+{
+    if (sb->p.gap_len) {
+        move_gap(sb, sb->p.len);
+        sb->p.gap_len = 0;
+        sb->p.buf[sb->p.len] = '\0';
+    }
+}
+
+static bool can_gap(strb_t const *sb)
+{
+    return !(sb->p.flags & F_OVERWRITE) && !is_external(sb);
+}
+#define gap_open(sb) ((sb)->p.gap_len != 0)
+#else
+#define close_gap(sb)
+#define gap_open(sb) false
+#endif
+
 #undef strb_ptr
 char *strb_ptr(strb_t *sb)
 {
     assert(sb);
     assert(!(sb->p.flags & F_IS_CONST));
+    close_gap(sb);
+    (void)unshare(sb, sb->p.len + 1); // on failure, the error indicator is set
+    HASH_INIT(&sb->p); // the caller may modify the string
+    LINES_CHANGE(sb, 0);
     return sb->p.buf;
 }
 
 const char *strb_cptr(strb_t const *sb)
 {
     assert(sb);
+    // Internal buffers are never const-qualified when defined.
+    close_gap((strb_t *)sb);
     return sb->p.buf;
 }
 
-size_t strb_len(strb_t const *sb )
+#if !STRB_FREESTANDING
+_Optional strb_t *strb_clone(strb_t const *sb)
 {
+    // The string is unchanged but its buffer may become shared
+    strb_t *const src = (strb_t *)sb;
+    _Optional strb_t *clone;
+
     assert(sb);
-    return sb->p.len;
-}
+    close_gap(src);
+
+#if !STRB_STATIC_ALLOC
+    if (is_shared(src) || (kind(src) == KIND_ALLOCATED && share(src))) {
+        clone = alloc_metadata(0);
+        if (!clone)
+            return NULL;
+
+        clone->p.buf = src->p.buf;
+        clone->p.len = clone->p.pos = src->p.len;
+        clone->p.size = src->p.size;
+        clone->p.flags = KIND_SHARED;
+        ++shared_hdr(src)->refs;
+        DEBUGF("Cloned %p as %p sharing %p\n", (void *)src, (void *)clone, (void *)src->p.buf);
+    } else
+#endif
+    {
+        // Internal or external buffers (or a buffer too full to share) are copied
+        clone = strb_alloc(src->p.len);
+        if (!clone)
+            return NULL;
+
+        memcpy(clone->p.buf, src->p.buf, src->p.len + 1);
+        clone->p.len = clone->p.pos = src->p.len;
+        DEBUGF("Cloned %p as %p by copying\n", (void *)src, (void *)clone);
+    }
+
+#if STRB_GAP
+    clone->p.gap_pos = clone->p.gap_len = 0;
+#endif
+    STAT_INIT(&clone->p);
+    LINES_INIT(&clone->p);
+#if STRB_HASH
+    clone->p.hash = src->p.hash;
+    clone->p.hashed = src->p.hashed;
+#endif
+#if STRB_UNPUTC
+    if (clone->p.len)
+        clone->p.flags |= F_CAN_UNPUTC;
+#endif
+    return clone;
+}
+#endif
+
+size_t strb_len(strb_t const *sb )
+{
+    assert(sb);
+    return sb->p.len;
+}
+
+#if STRB_HASH
+// Whether the hash of a string can be cached, which it can't be if the caller can modify
+// the string in its own array
+#define can_cache_hash(sb) (kind(sb) != KIND_USER && kind(sb) != KIND_USER_STATE)
+
+uint64_t strb_hash(strb_t const *sb)
+{
+    // The string is unchanged but the hash of its start is cached
+    strb_t *const hsb = (strb_t *)sb;
+    uint64_t h;
+    strbsize_t words;
+
+    assert(sb);
+    close_gap(hsb);
+
+    if (!can_cache_hash(sb)) {
+        words = sb->p.len / sizeof(uint64_t);
+        h = hash_words(HASH_SEED, sb->p.buf, words);
+        return hash_finish(h, sb->p.buf + words * sizeof(uint64_t), sb->p.len);
+    }
+
+    h = sb->p.hashed ? sb->p.hash : HASH_SEED;
+    words = (sb->p.len - sb->p.hashed) / sizeof(uint64_t);
+    if (words) {
+        DEBUGF("Hashing %" PRIstrbsize " words from %" PRIstrbsize "\n", words, sb->p.hashed);
+        h = hash_words(h, sb->p.buf + sb->p.hashed, words);
+        hsb->p.hash = h;
+        hsb->p.hashed += words * sizeof(uint64_t);
+    }
+    return hash_finish(h, sb->p.buf + sb->p.hashed, sb->p.len);
+}
+#endif
 
 static int set_err(strb_t *sb)
 {
@@ -447,7 +1164,7 @@ int strb_seek(strb_t *sb, size_t pos)
     assert(sb);
     assert(!(sb->p.flags & F_IS_CONST));
     DEBUGF("Seek to %zu\n", pos);
-    assert(sb->p.pos < sb->p.size);
+    assert(sb->p.pos < STRB_MAX_SIZE);
     if (pos < STRB_MAX_SIZE)
     {
         sb->p.pos = pos;
@@ -468,264 +1185,1873 @@ size_t strb_tell(strb_t const *sb )
         strbsize_t pos = sb->p.pos;
         DEBUGF("Pos %" PRIstrbsize ", len %" PRIstrbsize ", size %" PRIstrbsize "\n",
                pos, sb->p.len, sb->p.size);
-        assert(pos < sb->p.size);
+        assert(pos < STRB_MAX_SIZE);
         return pos;
     }
 }
 
-int strb_putc(strb_t *sb, int c)
+// Candidate positions for a needle are found by comparing its first and last characters
+// at many positions at once (128 with AVX2, 32 with SSE2, otherwise eight), then verified
+// without leaving the loop that found them. A search for a needle at least TWO_WAY_MIN_LEN
+// characters long switches to the Two-Way algorithm (which takes linear time) once the
+// number of characters verified exceeds twice the distance searched plus TWO_WAY_SLACK.
+#define TWO_WAY_MIN_LEN (32)
+#define TWO_WAY_SLACK (256)
+
+// Split a needle of at least 3 characters, returning the start of its right half
+// and the period of the whole needle (see glibc's str-two-way.h)
+static size_t critical_factorization(const unsigned char *needle, size_t len, size_t *period)
 {
-        return strb_nputc(sb, c, 1);
-}
+    size_t max_suffix = SIZE_MAX, max_suffix_rev = SIZE_MAX, j = 0, k = 1, p = 1;
+
+    // Maximal suffix for the ordering <
+    while (j + k < len) {
+        const unsigned char a = needle[j + k], b = needle[max_suffix + k];
+        if (a < b) {
+            j += k;
+            k = 1;
+            p = j - max_suffix;
+        } else if (a == b) {
+            if (k != p) {
+                ++k;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            max_suffix = j++;
+            k = p = 1;
+        }
+    }
+    *period = p;
+
+    // Maximal suffix for the ordering >
+    j = 0;
+    k = p = 1;
+    while (j + k < len) {
+        const unsigned char a = needle[j + k], b = needle[max_suffix_rev + k];
+        if (b < a) {
+            j += k;
+            k = 1;
+            p = j - max_suffix_rev;
+        } else if (a == b) {
+            if (k != p) {
+                ++k;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            max_suffix_rev = j++;
+            k = p = 1;
+        }
+    }
 
-int strb_nputc(strb_t *sb, int c, size_t n)
-{
-    _Optional char *buf = strb_write(sb, n);
-    if (!buf)
-        return EOF;
+    if (max_suffix_rev + 1 < max_suffix + 1)
+        return max_suffix + 1;
 
-    memset(buf, c, n);
-    // assume F_CAN_RESTORE isn't user-visible. Don't bother calling strb_restore.
-    return c;
+    *period = p;
+    return max_suffix_rev + 1;
 }
 
-#if STRB_UNPUTC
-int strb_unputc(strb_t *sb)
+// Find a needle of at least 3 characters by the Two-Way algorithm
+static _Optional const char *two_way(const unsigned char *hay, size_t hay_len,
+                                     const unsigned char *needle, size_t len)
 {
-    assert(sb);
-    assert(!(sb->p.flags & F_IS_CONST));
-    if (!(sb->p.flags & F_CAN_UNPUTC))
-        return set_err(sb);
-    
-    assert(sb->p.pos > 0);
-    assert(sb->p.pos < STRB_MAX_SIZE);
-    assert(sb->p.pos < sb->p.size);
-    assert(sb->p.pos <= sb->p.len);
+    size_t period, i, j = 0;
+    const size_t suffix = critical_factorization(needle, len, &period);
 
-    {
-        const strbsize_t new_pos = sb->p.pos - 1;
-        char removed = sb->p.buf[new_pos];
-        if (!(sb->p.flags & F_OVERWRITE)) {
-                memmove(sb->p.buf + new_pos, sb->p.buf + sb->p.pos, sb->p.len - new_pos);
-                --sb->p.len;
-        } else {
-                sb->p.buf[new_pos] = sb->p.unputc_char;
+    if (hay_len < len)
+        return NULL;
+
+    if (!memcmp(needle, needle + period, suffix)) {
+        // Periodic needle: remember how much of the left half is known to match
+        size_t memory = 0;
+
+        while (j <= hay_len - len) {
+            i = suffix > memory ? suffix : memory;
+            while (i < len && needle[i] == hay[i + j])
+                ++i;
+
+            if (i >= len) {
+                i = suffix - 1;
+                while (memory < i + 1 && needle[i] == hay[i + j])
+                    --i;
+                if (i + 1 < memory + 1)
+                    return (const char *)hay + j;
+
+                j += period;
+                memory = len - period;
+            } else {
+                j += i - suffix + 1;
+                memory = 0;
+            }
         }
+    } else {
+        period = (suffix > len - suffix ? suffix : len - suffix) + 1;
 
-        sb->p.pos = new_pos;
-        sb->p.flags &= ~(F_CAN_UNPUTC | F_CAN_RESTORE);
-        return removed;
+        while (j <= hay_len - len) {
+            i = suffix;
+            while (i < len && needle[i] == hay[i + j])
+                ++i;
+
+            if (i >= len) {
+                i = suffix - 1;
+                while (i != SIZE_MAX && needle[i] == hay[i + j])
+                    --i;
+                if (i == SIZE_MAX)
+                    return (const char *)hay + j;
+
+                j += period;
+            } else {
+                j += i - suffix + 1;
+            }
+        }
     }
+    return NULL;
 }
-#endif
 
-int strb_nputs(strb_t *restrict sb, const char *restrict str, size_t n)
+// State of a search for a needle of at least 2 characters
+typedef struct {
+    const char *hay, *needle;
+    size_t hay_len, len, verified;
+    _Optional const char *found;
+} filter_t;
+
+// Verify a candidate position at which the first and last characters of the needle match,
+// returning true if the search is finished (successfully or not)
+static inline bool verify_candidate(filter_t *f, size_t k)
 {
-    size_t len = strnlen(str, n);
-    _Optional char *buf = strb_write(sb, len);
-    if (!buf)
-            return EOF;
+    // Check the second character before calling memcmp, which is slower to reject most candidates
+    if ((f->len < 3 || f->hay[k + 1] == f->needle[1]) &&
+        !memcmp(f->hay + k + 1, f->needle + 1, f->len - 2)) {
+        f->found = f->hay + k;
+        return true;
+    }
 
-    memcpy(buf, str, len); // more efficient than strncpy
-    // assume F_CAN_RESTORE isn't user-visible. Don't bother calling strb_restore.
-    return 0;
+    f->verified += f->len;
+    if (f->len >= TWO_WAY_MIN_LEN && f->verified > 2 * k + TWO_WAY_SLACK) {
+        DEBUGF("Too many candidates for a needle of %zu chars at %zu\n", f->len, k);
+        f->found = two_way((const unsigned char *)f->hay + k + 1, f->hay_len - k - 1,
+                           (const unsigned char *)f->needle, f->len);
+        return true;
+    }
+    return false;
 }
 
-int strb_puts(strb_t *restrict sb, const char *restrict str )
+#if HAVE_AVX2
+// Get a mask of the 32 positions from p at which the first and last characters match
+__attribute__((target("avx2")))
+static inline __m256i match_avx2(const char *p, size_t len, __m256i vfirst, __m256i vlast)
 {
-    return strb_nputs(sb, str, SIZE_MAX);
+    return _mm256_and_si256(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(const void *)p), vfirst),
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(const void *)(p + len - 1)), vlast));
 }
 
-#if !STRB_FREESTANDING
-
-int strb_vputf(strb_t *restrict sb, const char *restrict format, va_list args)
+// Compare 128 positions at a time using AVX2, returning the number of positions searched
+// or SIZE_MAX if the search is finished
+__attribute__((target("avx2")))
+static size_t filter_avx2(filter_t *f, size_t end)
 {
-    va_list args_copy;
-    va_copy(args_copy, args);
-    {
-        const int len = vsnprintf(NULL, 0, format, args);
-        if (len >= 0) {
-            _Optional char *buf = strb_write(sb, (size_t)len); // move tail by +len and keep buf[len]
-            if (buf) {
-                int const tmp = buf[len];
-                vsprintf(buf, format, args_copy);
-                buf[len] = tmp;
-                DEBUGF("String is now %s\n", strb_ptr(sb));
-                va_end(args_copy);
-                return 0;
-            }
+    const char *const hay = f->hay;
+    const size_t len = f->len;
+    const __m256i vfirst = _mm256_set1_epi8(f->needle[0]),
+                  vlast = _mm256_set1_epi8(f->needle[len - 1]);
+    size_t k = 0;
+
+    for (; k + 4 * sizeof(__m256i) <= end; k += 4 * sizeof(__m256i)) {
+        const char *const p = hay + k;
+        const __m256i m0 = match_avx2(p, len, vfirst, vlast),
+                      m1 = match_avx2(p + 32, len, vfirst, vlast),
+                      m2 = match_avx2(p + 64, len, vfirst, vlast),
+                      m3 = match_avx2(p + 96, len, vfirst, vlast),
+                      any = _mm256_or_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m2, m3));
+
+        if (_mm256_testz_si256(any, any))
+            continue;
+
+        // Get all of the masks before verifying candidates, which can call memcmp
+        uint64_t lo = (uint32_t)_mm256_movemask_epi8(m0) |
+                      (uint64_t)(uint32_t)_mm256_movemask_epi8(m1) << 32,
+                 hi = (uint32_t)_mm256_movemask_epi8(m2) |
+                      (uint64_t)(uint32_t)_mm256_movemask_epi8(m3) << 32;
+
+        for (; lo; lo &= lo - 1) {
+            if (verify_candidate(f, k + (size_t)__builtin_ctzll(lo)))
+                return SIZE_MAX;
+        }
+        for (; hi; hi &= hi - 1) {
+            if (verify_candidate(f, k + 64 + (size_t)__builtin_ctzll(hi)))
+                return SIZE_MAX;
         }
     }
-    va_end(args_copy);
-    return set_err(sb);
+    return k;
 }
+#endif
 
-int strb_putf(strb_t *restrict sb, const char *restrict format, ...)
+// Find a needle of at least 2 characters
+static _Optional const char *filter_find(const char *hay, size_t hay_len,
+                                         const char *needle, size_t len)
 {
-    va_list args;
-    va_start(args, format);
+    const size_t end = hay_len - len + 1; // number of possible positions
+    const unsigned char first = (unsigned char)needle[0], last = (unsigned char)needle[len - 1];
+    const uint64_t firsts = first * BYTES_ONE, lasts = last * BYTES_ONE;
+    filter_t f = {hay, needle, hay_len, len, 0, NULL};
+    size_t k = 0;
+
+#if HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        k = filter_avx2(&f, end);
+        if (k == SIZE_MAX)
+            return f.found;
+    }
+#endif
+#if defined(__SSE2__)
     {
-        int e = strb_vputf(sb, format, args);
-        va_end(args);
-        return e;
+        // Compare 32 positions at once, then verify each candidate without leaving the loop
+        const __m128i vfirst = _mm_set1_epi8((char)first), vlast = _mm_set1_epi8((char)last);
+
+        for (; k + 2 * sizeof(__m128i) <= end; k += 2 * sizeof(__m128i)) {
+            const char *const p = hay + k;
+            const __m128i a0 = _mm_loadu_si128((const __m128i *)(const void *)p),
+                          a1 = _mm_loadu_si128((const __m128i *)(const void *)(p + 16)),
+                          b0 = _mm_loadu_si128((const __m128i *)(const void *)(p + len - 1)),
+                          b1 = _mm_loadu_si128((const __m128i *)(const void *)(p + len + 15));
+            uint32_t mask =
+                (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a0, vfirst),
+                                                          _mm_cmpeq_epi8(b0, vlast))) |
+                (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a1, vfirst),
+                                                          _mm_cmpeq_epi8(b1, vlast))) << 16;
+
+            for (; mask; mask &= mask - 1) {
+                if (verify_candidate(&f, k + (size_t)__builtin_ctz(mask)))
+                    return f.found;
+            }
+        }
+    }
+#endif
+
+    while (k < end) {
+        size_t stop = end;
+
+        for (; k + sizeof(uint64_t) <= end; k += sizeof(uint64_t)) {
+            uint64_t a, b;
+
+            memcpy(&a, hay + k, sizeof a);
+            memcpy(&b, hay + k + len - 1, sizeof b);
+            if (zero_bytes((a ^ firsts) | (b ^ lasts))) {
+                stop = k + sizeof(uint64_t); // the loop below finds the candidates in this word
+                break;
+            }
+        }
+
+        for (; k < stop; ++k) {
+            if ((unsigned char)hay[k] == first && (unsigned char)hay[k + len - 1] == last &&
+                verify_candidate(&f, k))
+                return f.found;
+        }
     }
+    return NULL;
 }
 
-#endif // !STRB_FREESTANDING
+// Find a needle of any length
+static _Optional const char *find_chars(const char *hay, size_t hay_len,
+                                        const char *needle, size_t len)
+{
+    if (len > hay_len)
+        return NULL;
+    if (len == 0)
+        return hay;
+    if (len == 1)
+        return memchr(hay, needle[0], hay_len);
+    return filter_find(hay, hay_len, needle, len);
+}
 
-static bool strb_ensure(strb_t *sb, size_t n, strbsize_t top)
+int strb_find(strb_t *restrict sb, const char *restrict needle, size_t len)
 {
+    _Optional const char *found;
+
     assert(sb);
+    assert(needle);
+    assert(sb->p.pos < STRB_MAX_SIZE);
 
-    if (n >= (size_t)STRB_MAX_SIZE - top) {
-        DEBUGF("Integer range exhausted (top=%" PRIstrbsize ", n=%zu)\n", top, n);
-        return false; // can't represent new length
+    if (sb->p.pos > sb->p.len || len > (size_t)(sb->p.len - sb->p.pos)) {
+        DEBUGF("No room for %zu chars at %" PRIstrbsize "\n", len, sb->p.pos);
+        return EOF;
     }
 
-    {
-        const strbsize_t room = sb->p.size > top ? sb->p.size - top : 0;
-        DEBUGF("Need %zu bytes, have %" PRIstrbsize " bytes\n", n, room);
-        if (n < room)
-            return true; // enough room for n chars and terminator
+    found = find_chars(strb_cptr(sb) + sb->p.pos, sb->p.len - sb->p.pos, needle, len);
+    if (!found) {
+        DEBUGF("Needle of %zu chars not found after %" PRIstrbsize "\n", len, sb->p.pos);
+        return EOF;
     }
 
-#if STRB_STATIC_ALLOC || STRB_FREESTANDING
-    DEBUGF("Fixed buffer exhausted\n");
-    return false;
-#else
-    if (sb->p.flags & F_EXTERNAL) {
-        DEBUGF("External buffer exhausted\n");
-        return false;
-    }
+    return strb_seek(sb, (size_t)(found - strb_cptr(sb)));
+}
 
-    strbsize_t new_size = sb->p.size <= (STRB_MAX_SIZE / STRB_GROW_FACTOR) ?
-                              sb->p.size * STRB_GROW_FACTOR :
-                              STRB_MAX_SIZE;
+int strb_seekstr(strb_t *restrict sb, const char *restrict needle)
+{
+    assert(needle);
+    return strb_find(sb, needle, strlen(needle));
+}
 
-    assert(top + n + 1 <= STRB_MAX_SIZE);
+#if STRB_LINES
+// Count the newline characters in a string of a given length
+static size_t count_newlines(const char *str, size_t len)
+{
+    size_t count = 0, k = 0;
 
-    if (new_size <= top + n)
-        new_size = top + n + 1; // +1 for terminator
+#if defined(__SSE2__)
+    // Count matches in each byte of a vector, then add up those counts before any can overflow
+    const __m128i newline = _mm_set1_epi8('\n');
 
-    char *new_buf = NULL;
-    if (sb->p.flags & F_ALLOCATED) {
-        new_buf = realloc(sb->p.buf, new_size);
-        if (!new_buf)
-            return false;
-    } else {
-        new_buf = malloc(new_size);
-        if (!new_buf)
-            return false;
-        memcpy(new_buf, sb->internal, sb->p.len + 1);
-    }
+    while (k + sizeof(__m128i) <= len) {
+        __m128i counts = _mm_setzero_si128(), sums;
+        size_t i;
 
-    sb->p.flags |= F_ALLOCATED;
-    sb->p.buf = new_buf;
-    sb->p.size = new_size;
-    DEBUGF("Substituted buffer %p of %" PRIstrbsize " bytes\n", new_buf, new_size);
-    return true;
+        for (i = 0; i < UCHAR_MAX && k + sizeof(__m128i) <= len; ++i, k += sizeof(__m128i)) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(str + k));
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(a, newline)); // each match is -1
+        }
+        sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
 #endif
+
+    for (; k + sizeof(uint64_t) <= len; k += sizeof(uint64_t)) {
+        uint64_t a;
+
+        memcpy(&a, str + k, sizeof a);
+        // Add up the high bits of matching bytes, shifted into the top byte
+        count += (size_t)(((zero_bytes(a ^ ('\n' * BYTES_ONE)) >> 7) * BYTES_ONE) >> 56);
+    }
+
+    for (; k < len; ++k)
+        count += str[k] == '\n';
+    return count;
 }
 
-_Optional char *strb_write(strb_t *sb, size_t n)
+// Extend the index of lines to the whole string, with room for the lines counted
+// in the rest of the string
+static bool index_lines(strb_t *sb)
 {
-    assert(sb);
-    assert(!(sb->p.flags & F_IS_CONST));
-    assert(sb->p.len < sb->p.size);
-    assert(sb->p.pos < sb->p.size);
-    assert(sb->p.buf[sb->p.len] == '\0');
-    DEBUGF("About to write %zu chars\n", n);
+    _Optional struct strblines_t *lines = sb->p.lines;
+    const char *const str = strb_cptr(sb);
+    const strbsize_t from = lines ? lines->indexed : 0;
+    const size_t n = lines ? lines->n : 1;
+    _Optional const char *nl;
+    size_t need, k;
+
+    if (lines && from == sb->p.len)
+        return true;
+
+    need = n + count_newlines(str + from, sb->p.len - from);
+    if (!lines || need > lines->size) {
+        const size_t max = (SIZE_MAX - sizeof(*lines)) / sizeof(lines->starts[0]);
+        size_t size = lines && lines->size <= max / 2 ? lines->size * 2 : 0;
+        _Optional struct strblines_t *new_lines;
+
+        if (need > max)
+            return false;
+        if (size < need)
+            size = need;
 
-    {
-        const strbsize_t old_len = sb->p.len, old_pos = sb->p.pos;
-        const strbsize_t top = (sb->p.flags & F_OVERWRITE) || old_pos > old_len ?
-                               old_pos : old_len;
+        new_lines = realloc(lines, sizeof(*lines) + size * sizeof(lines->starts[0]));
+        if (!new_lines)
+            return false;
 
-        if (!strb_ensure(sb, n, top)) {
-            DEBUGF("No room\n");
-            set_err(sb);
-            return NULL;
+        if (!lines) {
+            new_lines->starts[0] = 0;
+            new_lines->n = 1;
         }
+        new_lines->size = size;
+        sb->p.lines = lines = new_lines;
+    }
 
-        assert(old_pos < sb->p.size);
+    DEBUGF("Indexing %zu lines after %" PRIstrbsize "\n", need - n, from);
+    k = from;
+#if defined(__SSE2__)
+    {
+        // Record every newline among sixteen characters at once
+        const __m128i newline = _mm_set1_epi8('\n');
 
-        if (old_pos > old_len) {
-            DEBUGF("Zeroing between len %" PRIstrbsize " and pos %" PRIstrbsize "\n", old_len, old_pos + 1);
-            // +1 because there is no null terminator at pos yet
-            memset(sb->p.buf + old_len, '\0', old_pos - old_len + 1);
-            sb->p.len = old_pos;
+        for (; k + sizeof(__m128i) <= sb->p.len; k += sizeof(__m128i)) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(str + k));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(a, newline));
+
+            for (; mask; mask &= mask - 1)
+                lines->starts[lines->n++] = (strbsize_t)(k + (size_t)__builtin_ctz(mask) + 1);
         }
+    }
+#endif
 
-        assert(old_pos <= sb->p.len);
+    for (nl = memchr(str + k, '\n', sb->p.len - k); nl;
+         nl = memchr(nl + 1, '\n', (size_t)(str + sb->p.len - (nl + 1))))
+        lines->starts[lines->n++] = (strbsize_t)(nl - str) + 1;
 
-        {
-            _Optional char *buf = sb->p.buf + old_pos;
+    assert(lines->n == need);
+    lines->indexed = sb->p.len;
+    return true;
+}
 
-            if (!(sb->p.flags & F_OVERWRITE)) {
-                DEBUGF("Moving tail '%s' (%d) from %p to %p\n", buf, *buf, buf, buf + n);
-                memmove(buf + n, buf, sb->p.len + 1 - old_pos);
-                sb->p.len += n;
-            } else {
-#if STRB_UNPUTC
-                // Behave as if the write were implemented by multiple
-                // putc operations, which would imply null termination at
-                // each successive position.
-                sb->p.unputc_char = old_pos + n - 1 > old_len ? '\0' : buf[n - 1];
-#endif
-            }
+// Whether an index of lines can be attached to a string buffer object, which is only
+// released by strb_free or strb_detach
+#define can_index(sb) (kind(sb) != KIND_USER_STATE && kind(sb) != KIND_INTERNED)
 
-            sb->p.pos = old_pos + n;
-            DEBUGF("Pos advanced by %zu to %" PRIstrbsize "\n", n, sb->p.pos);
-            assert(sb->p.pos < sb->p.size);
+int strb_seekline(strb_t *sb, size_t line)
+{
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
 
-            if (sb->p.pos > sb->p.len) {
-                DEBUGF("Bumping length from %" PRIstrbsize " to %" PRIstrbsize "\n", sb->p.len, sb->p.pos);
-                sb->p.len = sb->p.pos;
-                buf[n] = '\0';
-            }
+    if (!can_index(sb)) {
+        // Scan from the start instead
+        const char *const str = strb_cptr(sb);
+        size_t pos = 0, n;
 
-#if STRB_RESTORE
-            sb->p.restore_char = buf[n];
-            sb->p.flags |= F_CAN_RESTORE;
-            DEBUGF("Stored %d ('%c') at %" PRIstrbsize "\n", sb->p.restore_char, sb->p.restore_char, sb->p.pos);
-#endif
+        for (n = 0; n < line; ++n) {
+            _Optional const char *const nl = memchr(str + pos, '\n', sb->p.len - pos);
+            if (!nl) {
+                DEBUGF("No line %zu of %zu\n", line, n + 1);
+                return EOF;
+            }
+            pos = (size_t)(nl - str) + 1;
+        }
+        return strb_seek(sb, pos);
+    }
 
-#if STRB_UNPUTC
-            if (n)
-                sb->p.flags |= F_CAN_UNPUTC;
-#endif
-            return buf;
+    if (!sb->p.lines || (line >= sb->p.lines->n && sb->p.lines->indexed < sb->p.len)) {
+        if (!index_lines(sb)) {
+            DEBUGF("Can't index lines\n");
+            return set_err(sb);
         }
     }
-}
 
-void strb_split(strb_t *sb)
-{
-    _Optional char *p = strb_write(sb, 0);
-    assert(p);
-    *(char *)p = '\0';
+    if (line >= sb->p.lines->n) {
+        DEBUGF("No line %zu of %zu\n", line, sb->p.lines->n);
+        return EOF;
+    }
+    return strb_seek(sb, sb->p.lines->starts[line]);
 }
 
-#if STRB_RESTORE
-void strb_restore(strb_t *sb)
+size_t strb_lineof(strb_t const *sb, size_t pos)
 {
+    // The string is unchanged but its index of lines may be extended
+    strb_t *const lsb = (strb_t *)sb;
+
     assert(sb);
-    assert(!(sb->p.flags & F_IS_CONST));
-    if (sb->p.flags & F_CAN_RESTORE) {
-        DEBUGF("Restored %d ('%c') at %" PRIstrbsize "\n", sb->p.restore_char, sb->p.restore_char, sb->p.pos);
-        sb->p.buf[sb->p.pos] = sb->p.restore_char;
-        sb->p.flags &= ~F_CAN_RESTORE;
+    if (pos > sb->p.len)
+        pos = sb->p.len;
+
+    if (!can_index(sb) ||
+        ((!sb->p.lines || pos > sb->p.lines->indexed) && !index_lines(lsb))) {
+        // Count the lines after any that were already indexed
+        const size_t n = sb->p.lines ? sb->p.lines->n : 1;
+        const strbsize_t from = sb->p.lines ? sb->p.lines->indexed : 0;
+
+        return n - 1 + count_newlines(strb_cptr(sb) + from, pos - from);
     }
+    return line_at(sb->p.lines, pos);
 }
-#endif
+#endif // STRB_LINES
 
-void strb_delto(strb_t *sb, size_t pos)
-{
-    strbsize_t hi, lo;
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+#define NO_PATTERN UINT32_MAX
+
+// An Aho-Corasick automaton, flattened into a table of transitions for each state and
+// class of character. Characters that appear in no pattern share a class.
+struct strbmatcher_t {
+    unsigned short classes[UCHAR_MAX + 1]; // class of each character
+    size_t nclasses;
+    uint32_t *next;                  // next state, indexed by state * nclasses + class
+    uint32_t *out_start, *out_count; // range of outputs for each state
+    uint32_t *outputs;               // indices of patterns matched at each state
+    size_t *lens;                    // length of each pattern
+};
+
+void strb_matcher_free(_Optional strbmatcher_t *m)
+{
+    if (!m)
+        return;
+
+    free(m->next);
+    free(m->out_start);
+    free(m->out_count);
+    free(m->outputs);
+    free(m->lens);
+    free(m);
+}
+
+// Build the trie of patterns, returning the number of states, or 0 on failure
+static size_t build_trie(strbmatcher_t *m, const char *const patterns[], size_t n,
+                         uint32_t *first, uint32_t *same)
+{
+    size_t nstates = 1, i, j;
+
+    for (i = 0; i < n; ++i) {
+        uint32_t state = 0;
+
+        for (j = 0; j < m->lens[i]; ++j) {
+            uint32_t *const edge =
+                &m->next[state * m->nclasses + m->classes[(unsigned char)patterns[i][j]]];
+            if (!*edge)
+                *edge = (uint32_t)nstates++; // the root is never the target of an edge
+            state = *edge;
+        }
+
+        if (m->lens[i]) {
+            // Chain patterns that end in the same state
+            same[i] = first[state];
+            first[state] = (uint32_t)i;
+        }
+    }
+    return nstates;
+}
+
+// Append a pattern index to the outputs of the automaton
+static bool add_output(strbmatcher_t *m, size_t *nout, size_t *out_size, uint32_t pattern)
+{
+    if (*nout == *out_size) {
+        _Optional uint32_t *new_out;
+
+        if (*out_size > SIZE_MAX / 2 / sizeof(*m->outputs))
+            return false;
+
+        new_out = realloc(m->outputs, *out_size * 2 * sizeof(*m->outputs));
+        if (!new_out)
+            return false;
+
+        m->outputs = new_out;
+        *out_size *= 2;
+    }
+    m->outputs[(*nout)++] = pattern;
+    return true;
+}
+
+// Add failure transitions to the trie, in breadth-first order, and gather the outputs
+// of each state (its own patterns followed by those of its longest proper suffix)
+static bool build_automaton(strbmatcher_t *m, size_t nstates, const uint32_t *first,
+                            const uint32_t *same)
+{
+    const size_t k = m->nclasses;
+    _Optional uint32_t *const queue = malloc(nstates * sizeof(*queue)),
+                       *const fail = malloc(nstates * sizeof(*fail));
+    size_t head = 0, tail = 0, nout = 0, out_size = nstates;
+    bool ok;
+
+    m->out_start = malloc(nstates * sizeof(*m->out_start));
+    m->out_count = malloc(nstates * sizeof(*m->out_count));
+    m->outputs = malloc(out_size * sizeof(*m->outputs));
+    ok = queue && fail && m->out_start && m->out_count && m->outputs;
+
+    if (ok) {
+        fail[0] = 0;
+        queue[tail++] = 0;
+    }
+
+    while (ok && head < tail) {
+        const uint32_t u = queue[head++];
+        uint32_t p;
+        size_t c, o;
+
+        for (c = 0; c < k; ++c) {
+            uint32_t *const edge = &m->next[u * k + c];
+            if (*edge) {
+                fail[*edge] = u ? m->next[fail[u] * k + c] : 0;
+                queue[tail++] = *edge;
+            } else if (u) {
+                *edge = m->next[fail[u] * k + c];
+            }
+        }
+
+        // The outputs of shallower states are already known
+        m->out_start[u] = (uint32_t)nout;
+        for (p = first[u]; ok && p != NO_PATTERN; p = same[p])
+            ok = add_output(m, &nout, &out_size, p);
+
+        if (u) {
+            const uint32_t f = fail[u];
+            for (o = 0; ok && o < m->out_count[f]; ++o)
+                ok = add_output(m, &nout, &out_size, m->outputs[m->out_start[f] + o]);
+        }
+        m->out_count[u] = (uint32_t)(nout - m->out_start[u]);
+    }
+    assert(!ok || tail == nstates);
+
+    free(queue);
+    free(fail);
+    return ok;
+}
+
+_Optional strbmatcher_t *strb_matcher_compile(const char *const patterns[], size_t n)
+{
+    _Optional strbmatcher_t *m;
+    _Optional uint32_t *first = NULL, *same = NULL;
+    size_t total = 0, i, j;
+    bool ok;
+
+    assert(patterns || !n);
+    if (n >= NO_PATTERN)
+        return NULL;
+
+    m = calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+
+    // Give each character that appears in a pattern its own class
+    m->nclasses = 1;
+    m->lens = malloc((n ? n : 1) * sizeof(*m->lens));
+    ok = m->lens != NULL;
+    for (i = 0; ok && i < n; ++i) {
+        assert(patterns[i]);
+        m->lens[i] = strlen(patterns[i]);
+        ok = m->lens[i] < NO_PATTERN - 1 - total;
+        total += m->lens[i];
+
+        for (j = 0; ok && j < m->lens[i]; ++j) {
+            unsigned short *const cls = &m->classes[(unsigned char)patterns[i][j]];
+            if (!*cls)
+                *cls = (unsigned short)m->nclasses++;
+        }
+    }
+
+    // The trie has at most one state per pattern character, plus the root
+    if (ok && total + 1 <= SIZE_MAX / sizeof(*m->next) / m->nclasses) {
+        m->next = calloc((total + 1) * m->nclasses, sizeof(*m->next));
+        first = malloc((total + 1) * sizeof(*first));
+        same = malloc((n ? n : 1) * sizeof(*same));
+        ok = m->next && first && same;
+    } else {
+        ok = false;
+    }
+
+    if (ok) {
+        size_t nstates;
+
+        for (i = 0; i <= total; ++i)
+            first[i] = NO_PATTERN;
+
+        nstates = build_trie(m, patterns, n, first, same);
+        if (nstates < total + 1) {
+            // Release the rows of states not needed because patterns share prefixes
+            _Optional uint32_t *const next =
+                realloc(m->next, nstates * m->nclasses * sizeof(*m->next));
+            if (next)
+                m->next = next;
+        }
+
+        ok = build_automaton(m, nstates, first, same);
+        DEBUGF("Compiled %zu patterns into %zu states of %zu classes\n", n, nstates, m->nclasses);
+    }
+
+    free(first);
+    free(same);
+    if (!ok) {
+        strb_matcher_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+int strb_match_all(strb_t const *sb, const strbmatcher_t *m, strbmatchfn_t *callback,
+                   _Optional void *arg)
+{
+    // Keep the tables in locals, since the callback might otherwise be assumed to change them
+    const uint32_t *const next = m->next, *const out_count = m->out_count;
+    const unsigned short *const classes = m->classes;
+    const size_t k = m->nclasses;
+    const char *str;
+    size_t state = 0, i, len;
+
+    assert(sb);
+    assert(m);
+    assert(callback);
+
+    str = strb_cptr(sb);
+    len = sb->p.len;
+    for (i = 0; i < len; ++i) {
+        state = next[state * k + classes[(unsigned char)str[i]]];
+        if (out_count[state]) {
+            const uint32_t *out = m->outputs + m->out_start[state],
+                           *const end = out + m->out_count[state];
+
+            for (; out < end; ++out) {
+                const int stop = callback(arg, *out, i + 1 - m->lens[*out]);
+                if (stop)
+                    return stop;
+            }
+        }
+    }
+    return 0;
+}
+#endif // !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+
+#if STRB_RESTORE
+#define TOK_VEC_MAX 4 // most delimiters to compare with whole words instead of looking up
+
+// A set of delimiters, with one bit for each character value, and a list of the first few
+typedef struct {
+    uint64_t bits[(UCHAR_MAX + 1) / 64];
+    unsigned char chars[TOK_VEC_MAX];
+    size_t nchars;
+} delimset_t;
+
+#define is_delim(set, c) (((set)->bits[(c) / 64] >> ((c) % 64)) & 1)
+
+static void delimset_init(delimset_t *set, const char *delims)
+{
+    memset(set, 0, sizeof(*set));
+    for (; *delims; ++delims) {
+        const unsigned char c = (unsigned char)*delims;
+
+        if (!is_delim(set, c)) {
+            set->bits[c / 64] |= (uint64_t)1 << (c % 64);
+            if (set->nchars < TOK_VEC_MAX)
+                set->chars[set->nchars] = c;
+            ++set->nchars;
+        }
+    }
+}
+
+// Find the first delimiter at or after k, or return end
+static size_t find_delim(const delimset_t *set, const char *str, size_t k, size_t end)
+{
+    if (set->nchars <= TOK_VEC_MAX) {
+        size_t d;
+#if defined(__SSE2__)
+        // Compare sixteen characters at once with each delimiter
+        __m128i vchars[TOK_VEC_MAX];
+
+        for (d = 0; d < set->nchars; ++d)
+            vchars[d] = _mm_set1_epi8((char)set->chars[d]);
+
+        for (; k + sizeof(__m128i) <= end; k += sizeof(__m128i)) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(str + k));
+            __m128i eq = _mm_setzero_si128();
+            unsigned int mask;
+
+            for (d = 0; d < set->nchars; ++d)
+                eq = _mm_or_si128(eq, _mm_cmpeq_epi8(a, vchars[d]));
+
+            mask = (unsigned int)_mm_movemask_epi8(eq);
+            if (mask)
+                return k + (size_t)__builtin_ctz(mask);
+        }
+#endif
+
+        for (; k + sizeof(uint64_t) <= end; k += sizeof(uint64_t)) {
+            uint64_t a, found = 0;
+
+            memcpy(&a, str + k, sizeof a);
+            for (d = 0; d < set->nchars; ++d)
+                found |= zero_bytes(a ^ (set->chars[d] * BYTES_ONE));
+            if (found)
+                break; // the loop below finds the delimiter, independent of byte order
+        }
+    }
+
+    while (k < end && !is_delim(set, (unsigned char)str[k]))
+        ++k;
+    return k;
+}
+
+void strb_tok_init(strb_tok_t *it, bool terminate)
+{
+    assert(it);
+    it->ptr = NULL;
+    it->len = 0;
+    it->terminate = terminate;
+    it->split = false;
+}
+
+int strb_tok_next(strb_t *restrict sb, strb_tok_t *restrict it, const char *restrict delims)
+{
+    delimset_t set;
+    const char *str;
+    size_t start, end, len;
+
+    assert(sb);
+    assert(it);
+    assert(delims);
+    assert(!(sb->p.flags & F_IS_CONST));
+
+    if (it->split) {
+        // Put back the delimiter overwritten to terminate the previous field
+        strb_restore(sb);
+        it->split = false;
+    }
+    it->ptr = NULL;
+    it->len = 0;
+
+    len = sb->p.len;
+    if (sb->p.pos >= len)
+        return EOF;
+
+    delimset_init(&set, delims);
+    str = strb_cptr(sb);
+    start = sb->p.pos;
+    while (start < len && is_delim(&set, (unsigned char)str[start]))
+        ++start;
+
+    if (start == len) {
+        DEBUGF("No more fields after %" PRIstrbsize "\n", sb->p.pos);
+        (void)strb_seek(sb, len);
+        return EOF;
+    }
+
+    end = find_delim(&set, str, start + 1, len);
+    (void)strb_seek(sb, end); // can't fail because end <= len
+
+    if (it->terminate && end < len) {
+        // Split the string as strb_split does, without the checks needed when the position
+        // might be beyond the end, but detecting failure to copy a shared buffer
+        if (!unshare(sb, len + 1))
+            return EOF;
+
+        HASH_CHANGE(sb, end);
+        LINES_CHANGE(sb, end);
+        str = sb->p.buf; // in case the buffer was copied
+        sb->p.restore_char = sb->p.buf[end];
+        sb->p.buf[end] = '\0';
+        sb->p.flags |= F_CAN_RESTORE;
+        it->split = true;
+    }
+
+    DEBUGF("Field of %zu chars at %zu\n", end - start, start);
+    it->ptr = str + start;
+    it->len = end - start;
+    return 0;
+}
+#endif // STRB_RESTORE
+
+#if STRB_GAP
+static _Optional char *put_write(strb_t *sb, size_t n);
+#else
+#define put_write(sb, n) strb_write(sb, n)
+#endif
+
+extern inline int strb_putc(strb_t *sb, int c);
+
+int strb_nputc(strb_t *sb, int c, size_t n)
+{
+    _Optional char *buf = put_write(sb, n);
+    if (!buf)
+        return EOF;
+
+    memset(buf, c, n);
+    // assume F_CAN_RESTORE isn't user-visible. Don't bother calling strb_restore.
+    return c;
+}
+
+#if STRB_UNPUTC
+int strb_unputc(strb_t *sb)
+{
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+    if (!(sb->p.flags & F_CAN_UNPUTC))
+        return set_err(sb);
+
+    if (!unshare(sb, sb->p.len + 1))
+        return EOF;
+
+    assert(sb->p.pos > 0);
+    assert(sb->p.pos < STRB_MAX_SIZE);
+    assert(sb->p.pos < sb->p.size);
+    assert(sb->p.pos <= sb->p.len);
+
+    {
+        const strbsize_t new_pos = sb->p.pos - 1;
+        char removed;
+
+        HASH_CHANGE(sb, new_pos);
+        LINES_CHANGE(sb, new_pos);
+#if STRB_GAP
+        if (can_gap(sb)) {
+                // Widen the gap downward instead of moving the tail
+                if (sb->p.gap_len)
+                        move_gap(sb, sb->p.pos);
+                removed = sb->p.buf[new_pos];
+                sb->p.gap_pos = new_pos;
+                ++sb->p.gap_len;
+                --sb->p.len;
+        } else
+#endif
+        {
+                close_gap(sb);
+                removed = sb->p.buf[new_pos];
+                if (!(sb->p.flags & F_OVERWRITE)) {
+                        memmove(sb->p.buf + new_pos, sb->p.buf + sb->p.pos, sb->p.len - new_pos);
+                        STAT_ADD(sb, moved, sb->p.len - new_pos);
+                        --sb->p.len;
+                } else {
+                        sb->p.buf[new_pos] = sb->p.unputc_char;
+                }
+        }
+
+        sb->p.pos = new_pos;
+        sb->p.flags &= ~(F_CAN_UNPUTC | F_CAN_RESTORE);
+        return removed;
+    }
+}
+#endif
+
+int strb_private_put(strb_t *restrict sb, const char *restrict str, size_t len)
+{
+    _Optional char *buf = put_write(sb, len);
+    if (!buf)
+            return EOF;
+
+    memcpy(buf, str, len); // more efficient than strncpy
+    // assume F_CAN_RESTORE isn't user-visible. Don't bother calling strb_restore.
+    return 0;
+}
+
+int strb_nputs(strb_t *restrict sb, const char *restrict str, size_t n)
+{
+    return strb_private_put(sb, str, strnlen(str, n));
+}
+
+extern inline int strb_puts(strb_t *restrict sb, const char *restrict str);
+
+/** Number of fragment lengths remembered between measuring and copying */
+#define PUTSV_CACHE 16
+
+// Common implementation of strb_putsv and strb_nputsv: exactly one of strs and
+// spans is non-null.
+static int putsv(strb_t *restrict sb, _Optional const char *const *strs,
+                 _Optional const strbspan_t *spans, size_t count)
+{
+    size_t lens[PUTSV_CACHE], total = 0, i;
+    _Optional char *buf;
+
+    assert(strs || spans);
+    assert(!strs || !spans);
+
+    // Measure every fragment first, so that room is made only once
+    for (i = 0; i < count; ++i) {
+        const size_t room = STRB_MAX_SIZE - total;
+        const size_t len = strs ? strnlen(strs[i], room) :
+                                  strnlen(spans[i].ptr, spans[i].len < room ? spans[i].len : room);
+        if (len == room) {
+            DEBUGF("Fragment %zu is too long\n", i);
+            return set_err(sb);
+        }
+        if (i < PUTSV_CACHE)
+            lens[i] = len;
+        total += len;
+    }
+
+    buf = put_write(sb, total);
+    if (!buf)
+        return EOF;
+
+    for (i = 0; i < count; ++i) {
+        const char *const str = strs ? strs[i] : spans[i].ptr;
+        const size_t len = i < PUTSV_CACHE ? lens[i] :
+                           strnlen(str, strs ? SIZE_MAX : spans[i].len);
+        memcpy(buf, str, len);
+        buf += len;
+    }
+    // assume F_CAN_RESTORE isn't user-visible. Don't bother calling strb_restore.
+    return 0;
+}
+
+int strb_putsv(strb_t *restrict sb, const char *const strs[], size_t count)
+{
+    assert(strs);
+    return putsv(sb, strs, NULL, count);
+}
+
+int strb_nputsv(strb_t *restrict sb, const strbspan_t spans[], size_t count)
+{
+    assert(spans);
+    return putsv(sb, NULL, spans, count);
+}
+
+#if STRB_NATIVE_FMT
+
+#define FMT_LEFT  (1<<0)
+#define FMT_PLUS  (1<<1)
+#define FMT_SPACE (1<<2)
+#define FMT_ALT   (1<<3)
+#define FMT_ZERO  (1<<4)
+
+/** Length modifiers */
+enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T, LEN_LD };
+
+/** Conversion specification */
+typedef struct {
+    int flags;
+    int width;
+    int precision; // negative if omitted
+    int length;
+    char conv;
+} fmt_spec;
+
+/** Destination for generated characters */
+typedef struct {
+    _Optional char *dest;   // where to store characters, or null to just count them
+    _Optional char *end;    // end of the space available for storing characters
+    size_t count;           // number of characters generated so far
+} fmt_out;
+
+// Get space for n characters, or a null pointer in *dest if only counting
+static bool fmt_space(fmt_out *out, size_t n, _Optional char **dest)
+{
+    if (n >= (size_t)STRB_MAX_SIZE - out->count) {
+        DEBUGF("Formatted output too long\n");
+        return false;
+    }
+    out->count += n;
+
+    if (out->dest && n > (size_t)(out->end - out->dest))
+        out->dest = NULL; // out of space, so count the rest
+
+    *dest = out->dest;
+    if (out->dest)
+        out->dest += n;
+
+    return true;
+}
+
+static bool fmt_put(fmt_out *out, const char *str, size_t n)
+{
+    _Optional char *dest;
+    if (!n)
+        return true;
+
+    if (!fmt_space(out, n, &dest))
+        return false;
+
+    if (dest)
+        memcpy(dest, str, n);
+
+    return true;
+}
+
+static bool fmt_pad(fmt_out *out, int c, size_t n)
+{
+    _Optional char *dest;
+    if (!n)
+        return true;
+
+    if (!fmt_space(out, n, &dest))
+        return false;
+
+    if (dest)
+        memset(dest, c, n);
+
+    return true;
+}
+
+// Put characters padded with spaces to the field width
+static bool fmt_field(fmt_out *out, const fmt_spec *spec, const char *str, size_t n)
+{
+    const size_t pad = (size_t)spec->width > n ? (size_t)spec->width - n : 0;
+
+    return ((spec->flags & FMT_LEFT) || fmt_pad(out, ' ', pad)) &&
+           fmt_put(out, str, n) &&
+           (!(spec->flags & FMT_LEFT) || fmt_pad(out, ' ', pad));
+}
+
+static bool fmt_int(fmt_out *out, const fmt_spec *spec, uintmax_t value, bool negative)
+{
+    char digits[(sizeof(value) * CHAR_BIT + 2) / 3]; // enough for octal
+    const char *const xdigits = spec->conv == 'X' ? "0123456789ABCDEF" : "0123456789abcdef";
+    const unsigned base = spec->conv == 'o' ? 8 :
+                          (spec->conv == 'x' || spec->conv == 'X') ? 16 : 10;
+    const size_t precision = spec->precision < 0 ? 1 : (size_t)spec->precision;
+    size_t ndigits = 0, nzeros = 0, nprefix = 0, total, pad = 0;
+    char prefix[2];
+
+    if (spec->conv == 'd' || spec->conv == 'i') {
+        if (negative)
+            prefix[nprefix++] = '-';
+        else if (spec->flags & FMT_PLUS)
+            prefix[nprefix++] = '+';
+        else if (spec->flags & FMT_SPACE)
+            prefix[nprefix++] = ' ';
+    } else if (base == 16 && (spec->flags & FMT_ALT) && value) {
+        prefix[nprefix++] = '0';
+        prefix[nprefix++] = spec->conv;
+    }
+
+    for (; value; value /= base)
+        digits[sizeof(digits) - ++ndigits] = xdigits[value % base];
+
+    if (ndigits < precision)
+        nzeros = precision - ndigits;
+
+    if (base == 8 && (spec->flags & FMT_ALT) && !nzeros)
+        nzeros = 1; // force the first digit to be zero
+
+    total = nprefix + nzeros + ndigits;
+    if ((size_t)spec->width > total) {
+        pad = (size_t)spec->width - total;
+        if ((spec->flags & (FMT_LEFT | FMT_ZERO)) == FMT_ZERO && spec->precision < 0) {
+            nzeros += pad;
+            pad = 0;
+        }
+    }
+
+    return ((spec->flags & FMT_LEFT) || fmt_pad(out, ' ', pad)) &&
+           fmt_put(out, prefix, nprefix) &&
+           fmt_pad(out, '0', nzeros) &&
+           fmt_put(out, digits + sizeof(digits) - ndigits, ndigits) &&
+           (!(spec->flags & FMT_LEFT) || fmt_pad(out, ' ', pad));
+}
+
+static bool fmt_signed(fmt_out *out, const fmt_spec *spec, va_list *ap)
+{
+    intmax_t value;
+
+    switch (spec->length) {
+    case LEN_HH: value = (signed char)va_arg(*ap, int); break;
+    case LEN_H:  value = (short)va_arg(*ap, int); break;
+    case LEN_L:  value = va_arg(*ap, long); break;
+    case LEN_LL: value = va_arg(*ap, long long); break;
+    case LEN_J:  value = va_arg(*ap, intmax_t); break;
+    case LEN_Z:  // signed type corresponding to size_t
+    case LEN_T:  value = va_arg(*ap, ptrdiff_t); break;
+    default:     value = va_arg(*ap, int); break;
+    }
+
+    return fmt_int(out, spec,
+                   value < 0 ? (uintmax_t)0 - (uintmax_t)value : (uintmax_t)value,
+                   value < 0);
+}
+
+static bool fmt_unsigned(fmt_out *out, const fmt_spec *spec, va_list *ap)
+{
+    uintmax_t value;
+
+    switch (spec->length) {
+    case LEN_HH: value = (unsigned char)va_arg(*ap, unsigned int); break;
+    case LEN_H:  value = (unsigned short)va_arg(*ap, unsigned int); break;
+    case LEN_L:  value = va_arg(*ap, unsigned long); break;
+    case LEN_LL: value = va_arg(*ap, unsigned long long); break;
+    case LEN_J:  value = va_arg(*ap, uintmax_t); break;
+    case LEN_Z:  // unsigned type corresponding to ptrdiff_t
+    case LEN_T:  value = va_arg(*ap, size_t); break;
+    default:     value = va_arg(*ap, unsigned int); break;
+    }
+
+    return fmt_int(out, spec, value, false);
+}
+
+static void fmt_count(const fmt_spec *spec, size_t count, va_list *ap)
+{
+    switch (spec->length) {
+    case LEN_HH: *va_arg(*ap, signed char *) = (signed char)count; break;
+    case LEN_H:  *va_arg(*ap, short *) = (short)count; break;
+    case LEN_L:  *va_arg(*ap, long *) = (long)count; break;
+    case LEN_LL: *va_arg(*ap, long long *) = (long long)count; break;
+    case LEN_J:  *va_arg(*ap, intmax_t *) = (intmax_t)count; break;
+    case LEN_Z:  *va_arg(*ap, size_t *) = count; break;
+    case LEN_T:  *va_arg(*ap, ptrdiff_t *) = (ptrdiff_t)count; break;
+    default:     *va_arg(*ap, int *) = (int)count; break;
+    }
+}
+
+#if !STRB_FREESTANDING
+/** Argument of a conversion delegated to the C library */
+typedef union {
+    double d;
+    long double ld;
+    void *p;
+    wint_t wc;
+    wchar_t *ws;
+} fmt_arg;
+
+/** Types of argument of a conversion delegated to the C library */
+enum { ARG_DOUBLE, ARG_LONG_DOUBLE, ARG_POINTER, ARG_WINT, ARG_WSTRING };
+
+static int fmt_libc_call(char *dest, size_t size, const char *format, int type, const fmt_arg *arg)
+{
+    switch (type) {
+    case ARG_DOUBLE:      return snprintf(dest, size, format, arg->d);
+    case ARG_LONG_DOUBLE: return snprintf(dest, size, format, arg->ld);
+    case ARG_POINTER:     return snprintf(dest, size, format, arg->p);
+    case ARG_WINT:        return snprintf(dest, size, format, arg->wc);
+    default:              return snprintf(dest, size, format, arg->ws);
+    }
+}
+
+// Generate characters for a conversion that isn't handled natively
+static bool fmt_libc(fmt_out *out, const fmt_spec *spec, va_list *ap)
+{
+    static const char *const lengths[] = {
+        [LEN_NONE] = "", [LEN_HH] = "hh", [LEN_H] = "h", [LEN_L] = "l", [LEN_LL] = "ll",
+        [LEN_J] = "j", [LEN_Z] = "z", [LEN_T] = "t", [LEN_LD] = "L"
+    };
+    char format[32], scratch[FMT_SCRATCH_SIZE];
+    fmt_arg arg;
+    int type, n;
+
+    switch (spec->conv) {
+    case 'a': case 'A': case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+        if (spec->length == LEN_LD) {
+            type = ARG_LONG_DOUBLE;
+            arg.ld = va_arg(*ap, long double);
+        } else {
+            type = ARG_DOUBLE;
+            arg.d = va_arg(*ap, double);
+        }
+        break;
+    case 'p':
+        type = ARG_POINTER;
+        arg.p = va_arg(*ap, void *);
+        break;
+    case 'c':
+        type = ARG_WINT;
+        arg.wc = va_arg(*ap, wint_t);
+        break;
+    case 's':
+        type = ARG_WSTRING;
+        arg.ws = va_arg(*ap, wchar_t *);
+        break;
+    default:
+        DEBUGF("Bad conversion %c\n", spec->conv);
+        return false;
+    }
+
+    // Rebuild the conversion specification without any asterisks, omitting a width or precision
+    // that wasn't given (a width of 0 would become a '0' flag, which is undefined for some types)
+    {
+        char *f = format;
+
+        f += sprintf(f, "%%%s%s%s%s%s",
+                     spec->flags & FMT_LEFT ? "-" : "", spec->flags & FMT_PLUS ? "+" : "",
+                     spec->flags & FMT_SPACE ? " " : "", spec->flags & FMT_ALT ? "#" : "",
+                     spec->flags & FMT_ZERO ? "0" : "");
+        if (spec->width > 0)
+            f += sprintf(f, "%d", spec->width);
+        if (spec->precision >= 0)
+            f += sprintf(f, ".%d", spec->precision);
+        sprintf(f, "%s%c", lengths[spec->length], spec->conv);
+    }
+
+    n = fmt_libc_call(scratch, sizeof scratch, format, type, &arg);
+    if (n < 0)
+        return false;
+
+    if ((size_t)n < sizeof scratch)
+        return fmt_put(out, scratch, (size_t)n);
+
+    {
+        // Output didn't fit, so generate it again in place
+        _Optional char *dest;
+        if (!fmt_space(out, (size_t)n, &dest))
+            return false;
+
+        if (dest) {
+            const char tmp = dest[n];
+            fmt_libc_call(dest, (size_t)n + 1, format, type, &arg);
+            dest[n] = tmp;
+        }
+    }
+    return true;
+}
+#else
+static bool fmt_libc(fmt_out *out, const fmt_spec *spec, va_list *ap)
+{
+    (void)out;
+    (void)spec;
+    (void)ap;
+    DEBUGF("Unsupported conversion %c\n", spec->conv);
+    return false;
+}
+#endif // !STRB_FREESTANDING
+
+// Parse a decimal field width or precision
+static const char *fmt_number(const char *p, int *value)
+{
+    int n = 0;
+    for (; *p >= '0' && *p <= '9'; ++p) {
+        if (n > (INT_MAX - (*p - '0')) / 10)
+            n = INT_MAX; // saturate so that the output is too long
+        else
+            n = (n * 10) + (*p - '0');
+    }
+    *value = n;
+    return p;
+}
+
+static bool fmt_core(fmt_out *out, const char *format, va_list *ap)
+{
+    const char *p = format;
+
+    while (*p) {
+        const char *const literal = p;
+        fmt_spec spec = {0, 0, -1, LEN_NONE, '\0'};
+        bool ok;
+
+        while (*p && *p != '%')
+            ++p;
+
+        if (!fmt_put(out, literal, (size_t)(p - literal)))
+            return false;
+
+        if (!*p)
+            break;
+
+        for (++p; ; ++p) {
+            if (*p == '-') spec.flags |= FMT_LEFT;
+            else if (*p == '+') spec.flags |= FMT_PLUS;
+            else if (*p == ' ') spec.flags |= FMT_SPACE;
+            else if (*p == '#') spec.flags |= FMT_ALT;
+            else if (*p == '0') spec.flags |= FMT_ZERO;
+            else break;
+        }
+
+        if (*p == '*') {
+            spec.width = va_arg(*ap, int);
+            if (spec.width < 0) {
+                spec.flags |= FMT_LEFT;
+                spec.width = spec.width == INT_MIN ? INT_MAX : -spec.width;
+            }
+            ++p;
+        } else {
+            p = fmt_number(p, &spec.width);
+        }
+
+        if (*p == '.') {
+            if (*++p == '*') {
+                spec.precision = va_arg(*ap, int); // negative means omitted
+                ++p;
+            } else {
+                p = fmt_number(p, &spec.precision);
+            }
+        }
+
+        switch (*p) {
+        case 'h':
+            spec.length = LEN_H;
+            if (*++p == 'h') {
+                spec.length = LEN_HH;
+                ++p;
+            }
+            break;
+        case 'l':
+            spec.length = LEN_L;
+            if (*++p == 'l') {
+                spec.length = LEN_LL;
+                ++p;
+            }
+            break;
+        case 'j': spec.length = LEN_J; ++p; break;
+        case 'z': spec.length = LEN_Z; ++p; break;
+        case 't': spec.length = LEN_T; ++p; break;
+        case 'L': spec.length = LEN_LD; ++p; break;
+        }
+
+        spec.conv = *p;
+        if (!spec.conv) {
+            DEBUGF("Incomplete conversion specification\n");
+            return false;
+        }
+        ++p;
+
+        switch (spec.conv) {
+        case 'd':
+        case 'i':
+            ok = fmt_signed(out, &spec, ap);
+            break;
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            ok = fmt_unsigned(out, &spec, ap);
+            break;
+
+        case 'c':
+            if (spec.length != LEN_NONE) {
+                ok = fmt_libc(out, &spec, ap); // wide character
+            } else {
+                const char c = (char)va_arg(*ap, int);
+                ok = fmt_field(out, &spec, &c, 1);
+            }
+            break;
+
+        case 's':
+            if (spec.length != LEN_NONE) {
+                ok = fmt_libc(out, &spec, ap); // wide string
+            } else {
+                _Optional const char *str = va_arg(*ap, const char *);
+                if (!str)
+                    str = "(null)";
+                ok = fmt_field(out, &spec, str,
+                               strnlen(str, spec.precision < 0 ? SIZE_MAX : (size_t)spec.precision));
+            }
+            break;
+
+        case '%':
+            ok = fmt_put(out, "%", 1);
+            break;
+
+        case 'n':
+            fmt_count(&spec, out->count, ap);
+            ok = true;
+            break;
+
+        default:
+            ok = fmt_libc(out, &spec, ap);
+            break;
+        }
+
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+int strb_vputf(strb_t *restrict sb, const char *restrict format, va_list args)
+{
+    fmt_out out = {NULL, NULL, 0};
+    _Optional char *start = NULL;
+    va_list ap, ap_copy;
+    bool ok;
+
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+
+    if (!unshare(sb, sb->p.len + 1))
+        return EOF;
+
+    // Try to generate characters directly into free space at the current position
+    if (sb->p.pos == sb->p.len && !gap_open(sb)) {
+        start = sb->p.buf + sb->p.len;
+        out.end = sb->p.buf + sb->p.size - 1;
+    }
+#if STRB_GAP
+    else if (can_gap(sb) && sb->p.gap_len && sb->p.gap_pos == sb->p.pos) {
+        start = sb->p.buf + sb->p.pos;
+        out.end = start + sb->p.gap_len;
+    }
+#endif
+    out.dest = start;
+
+    va_copy(ap, args);
+    va_copy(ap_copy, args);
+    ok = fmt_core(&out, format, &ap);
+    STAT_ADD(sb, formats, 1);
+
+    if (ok && out.dest) {
+        // All characters were generated in place
+        const char first = *start;
+        *start = '\0'; // strb_write expects the original terminator when appending
+        out.dest = put_write(sb, out.count); // can't fail or substitute another buffer
+        assert(out.dest == start);
+        *start = first;
+    } else {
+        if (start)
+            *start = '\0'; // undo any characters generated in place
+
+        if (ok) {
+            // Make room for the characters, moving the tail (if any) only once,
+            // then generate them again
+            const strbsize_t old_len = sb->p.len, old_pos = sb->p.pos;
+
+            out.dest = put_write(sb, out.count);
+            ok = out.dest != NULL;
+            if (ok) {
+                out.end = out.dest + out.count;
+                out.count = 0;
+                ok = fmt_core(&out, format, &ap_copy);
+                STAT_ADD(sb, formats, 1);
+
+                if (!ok && !(sb->p.flags & F_OVERWRITE)) {
+                    // Remove the inserted characters, and any padding before them
+                    strb_delto(sb, old_pos);
+                    if (old_pos > old_len) {
+                        strb_seek(sb, old_len);
+                        strb_delto(sb, old_pos);
+                        strb_seek(sb, old_pos);
+                    }
+                }
+            }
+        }
+    }
+    va_end(ap_copy);
+    va_end(ap);
+
+    if (!ok)
+        return set_err(sb);
+
+    DEBUGF("String is now %s\n", strb_ptr(sb));
+    return 0;
+}
+
+#elif !STRB_FREESTANDING
+
+int strb_vputf(strb_t *restrict sb, const char *restrict format, va_list args)
+{
+    char scratch[FMT_SCRATCH_SIZE];
+    _Optional char *buf = NULL;
+    bool fitted = false;
+    va_list args_copy;
+    int len;
+
+    assert(sb);
+    if (!unshare(sb, sb->p.len + 1))
+        return EOF;
+
+    va_copy(args_copy, args);
+
+    if (sb->p.pos == sb->p.len && !gap_open(sb)) {
+        // Appending, so generate characters directly into the free space at the end
+        char *const end = sb->p.buf + sb->p.len;
+        const size_t room = sb->p.size - sb->p.len;
+
+        len = vsnprintf(end, room, format, args);
+        STAT_ADD(sb, formats, 1);
+        if (len >= 0 && (size_t)len < room) {
+            const char first = *end;
+            *end = '\0'; // strb_write expects the original terminator
+            buf = strb_write(sb, (size_t)len); // can't fail or substitute another buffer
+            assert(buf == end);
+            *end = first;
+            fitted = true;
+        } else {
+            *end = '\0'; // undo truncated output
+        }
+    } else {
+        // Generate characters into a scratch array to avoid moving the tail before
+        // knowing how far to move it
+        len = vsnprintf(scratch, sizeof scratch, format, args);
+        STAT_ADD(sb, formats, 1);
+        if (len >= 0 && (size_t)len < sizeof scratch) {
+            buf = put_write(sb, (size_t)len);
+            if (buf)
+                memcpy(buf, scratch, (size_t)len);
+            fitted = true;
+        }
+    }
+
+    if (!fitted && len >= 0) {
+        // Output didn't fit, so make room for it and generate it again
+        buf = put_write(sb, (size_t)len); // move tail by +len and keep buf[len]
+        if (buf) {
+            int const tmp = buf[len];
+            vsprintf(buf, format, args_copy);
+            STAT_ADD(sb, formats, 1);
+            buf[len] = tmp;
+        }
+    }
+    va_end(args_copy);
+
+    if (!buf)
+        return set_err(sb);
+
+    DEBUGF("String is now %s\n", strb_ptr(sb));
+    return 0;
+}
+#endif // STRB_NATIVE_FMT
+
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
+
+int strb_putf(strb_t *restrict sb, const char *restrict format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    {
+        int e = strb_vputf(sb, format, args);
+        va_end(args);
+        return e;
+    }
+}
+
+#endif // !STRB_FREESTANDING || STRB_NATIVE_FMT
+
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+static strbgrowth_t growth = {STRB_GROW_FACTOR * 100, 0, 0};
+
+void strb_setgrowth(_Optional const strbgrowth_t *policy)
+{
+    if (policy) {
+        growth = *policy;
+    } else {
+        growth.percent = STRB_GROW_FACTOR * 100;
+        growth.max_step = growth.granularity = 0;
+    }
+}
+
+void strb_getgrowth(strbgrowth_t *policy)
+{
+    assert(policy);
+    *policy = growth;
+}
+
+static size_t add_sat(size_t a, size_t b)
+{
+    return b > SIZE_MAX - a ? SIZE_MAX : a + b;
+}
+
+// Size of the buffer to substitute for one of the given size, according to the
+// growth policy. The result is at least need.
+static strbsize_t grow_size(strbsize_t size, size_t need)
+{
+    size_t new_size = size;
+
+    assert(need <= STRB_MAX_SIZE);
+    if (growth.percent > 100) {
+        // Calculate size * (percent - 100) / 100 without overflow
+        const size_t pc = growth.percent - 100u, whole = size / 100u, part = size % 100u;
+        size_t extra = whole > SIZE_MAX / pc ? SIZE_MAX : whole * pc;
+
+        extra = add_sat(extra, part * (pc / 100u));
+        extra = add_sat(extra, part * (pc % 100u) / 100u);
+        if (growth.max_step && extra > growth.max_step)
+            extra = growth.max_step;
+
+        new_size = add_sat(new_size, extra);
+    }
+
+    if (new_size < need)
+        new_size = need;
+
+    if (growth.granularity > 1) {
+        const size_t rem = new_size % growth.granularity;
+        if (rem)
+            new_size = add_sat(new_size, growth.granularity - rem);
+    }
+
+    return new_size > STRB_MAX_SIZE ? STRB_MAX_SIZE : (strbsize_t)new_size;
+}
+
+// Substitute a buffer of the given size, which must be big enough for the
+// string and position. The gap (if any) must be closed.
+static bool resize(strb_t *sb, strbsize_t new_size)
+{
+    char *new_buf = NULL;
+
+    assert(!gap_open(sb));
+    assert(!is_shared(sb));
+    assert(new_size > sb->p.len);
+    assert(new_size > sb->p.pos);
+
+    if (kind(sb) == KIND_ALLOCATED) {
+        new_buf = buf_realloc(sb->p.buf, sb->p.size, &new_size, sb->p.len + 1);
+        if (!new_buf)
+            return false;
+    } else {
+        new_buf = buf_alloc(&new_size);
+        if (!new_buf)
+            return false;
+        memcpy(new_buf, sb->internal, sb->p.len + 1);
+    }
+
+    set_kind(sb, KIND_ALLOCATED);
+    sb->p.buf = new_buf;
+    sb->p.size = new_size;
+    STAT_ADD(sb, reallocs, 1);
+    DEBUGF("Substituted buffer %p of %" PRIstrbsize " bytes\n", new_buf, new_size);
+    return true;
+}
+#endif // !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+
+static bool strb_ensure(strb_t *sb, size_t n, strbsize_t top)
+{
+    assert(sb);
 
+    if (n >= (size_t)STRB_MAX_SIZE - top) {
+        DEBUGF("Integer range exhausted (top=%" PRIstrbsize ", n=%zu)\n", top, n);
+        return false; // can't represent new length
+    }
+
+    {
+        const strbsize_t room = sb->p.size > top ? sb->p.size - top : 0;
+        DEBUGF("Need %zu bytes, have %" PRIstrbsize " bytes\n", n, room);
+        if (n < room)
+            return true; // enough room for n chars and terminator
+    }
+
+#if STRB_STATIC_ALLOC || STRB_FREESTANDING
+    DEBUGF("Fixed buffer exhausted\n");
+    return false;
+#else
+    if (is_external(sb)) {
+        DEBUGF("External buffer exhausted\n");
+        return false;
+    }
+
+    assert(top + n + 1 <= STRB_MAX_SIZE);
+    return resize(sb, grow_size(sb->p.size, top + n + 1)); // +1 for terminator
+#endif
+}
+
+#if STRB_GAP
+// Equivalent to strb_write except that, in insert mode, characters following
+// the current position are moved only when the gap is too small. Unlike
+// strb_write, it does not allow a terminator to be written after the n
+// characters, therefore it must not be used to implement strb_write or strb_split.
+static _Optional char *put_write(strb_t *sb, size_t n)
+{
     assert(sb);
     assert(!(sb->p.flags & F_IS_CONST));
-    assert(sb->p.pos < sb->p.size);
+
+    if (!can_gap(sb) || sb->p.pos > sb->p.len ||
+        (!sb->p.gap_len && sb->p.pos == sb->p.len))
+        return strb_write(sb, n); // no tail to move
+
+    HASH_CHANGE(sb, sb->p.pos);
+    LINES_CHANGE(sb, sb->p.pos);
+    {
+        const strbsize_t pos = sb->p.pos;
+        char *buf;
+
+        if (n > sb->p.gap_len) {
+            // Refill the gap with all spare capacity, growing the buffer if necessary
+            close_gap(sb);
+            if (!strb_ensure(sb, n, sb->p.len)) {
+                DEBUGF("No room\n");
+                set_err(sb);
+                return NULL;
+            }
+            sb->p.gap_pos = pos;
+            sb->p.gap_len = sb->p.size - sb->p.len - 1;
+            DEBUGF("Opening gap of %" PRIstrbsize " at %" PRIstrbsize "\n", sb->p.gap_len, pos);
+            memmove(sb->p.buf + pos + sb->p.gap_len, sb->p.buf + pos, sb->p.len + 1 - pos);
+            STAT_ADD(sb, moved, sb->p.len + 1 - pos);
+        } else {
+            move_gap(sb, pos);
+        }
+
+        buf = sb->p.buf + pos;
+        sb->p.gap_pos += n;
+        sb->p.gap_len -= n;
+        sb->p.len += n;
+        sb->p.pos += n;
+        DEBUGF("Pos advanced by %zu to %" PRIstrbsize "\n", n, sb->p.pos);
+
+        sb->p.flags &= ~F_CAN_RESTORE;
+#if STRB_UNPUTC
+        if (n)
+            sb->p.flags |= F_CAN_UNPUTC;
+#endif
+        return buf;
+    }
+}
+#endif // STRB_GAP
+
+_Optional char *strb_write(strb_t *sb, size_t n)
+{
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+    assert(sb->p.len < sb->p.size);
+    assert(sb->p.pos < STRB_MAX_SIZE);
+    close_gap(sb);
+    assert(sb->p.buf[sb->p.len] == '\0');
+    DEBUGF("About to write %zu chars\n", n);
+
+    if (!unshare(sb, sb->p.len + 1))
+        return NULL;
+
+    HASH_CHANGE(sb, sb->p.pos);
+    LINES_CHANGE(sb, sb->p.pos);
+    {
+        const strbsize_t old_len = sb->p.len, old_pos = sb->p.pos;
+        const strbsize_t top = (sb->p.flags & F_OVERWRITE) || old_pos > old_len ?
+                               old_pos : old_len;
+
+        if (!strb_ensure(sb, n, top)) {
+            DEBUGF("No room\n");
+            set_err(sb);
+            return NULL;
+        }
+
+        assert(old_pos < sb->p.size);
+
+        if (old_pos > old_len) {
+            DEBUGF("Zeroing between len %" PRIstrbsize " and pos %" PRIstrbsize "\n", old_len, old_pos + 1);
+            // +1 because there is no null terminator at pos yet
+            memset(sb->p.buf + old_len, '\0', old_pos - old_len + 1);
+            STAT_ADD(sb, zeroed, old_pos - old_len + 1);
+            sb->p.len = old_pos;
+        }
+
+        assert(old_pos <= sb->p.len);
+
+        {
+            _Optional char *buf = sb->p.buf + old_pos;
+
+            if (!(sb->p.flags & F_OVERWRITE)) {
+                if (n) { // nothing to move for strb_split
+                    DEBUGF("Moving tail '%s' (%d) from %p to %p\n", buf, *buf, buf, buf + n);
+                    memmove(buf + n, buf, sb->p.len + 1 - old_pos);
+                    STAT_ADD(sb, moved, sb->p.len + 1 - old_pos);
+                    sb->p.len += n;
+                }
+            } else {
+#if STRB_UNPUTC
+                // Behave as if the write were implemented by multiple
+                // putc operations, which would imply null termination at
+                // each successive position.
+                sb->p.unputc_char = old_pos + n - 1 > old_len ? '\0' : buf[n - 1];
+#endif
+            }
+
+            sb->p.pos = old_pos + n;
+            DEBUGF("Pos advanced by %zu to %" PRIstrbsize "\n", n, sb->p.pos);
+            assert(sb->p.pos < sb->p.size);
+
+            if (sb->p.pos > sb->p.len) {
+                DEBUGF("Bumping length from %" PRIstrbsize " to %" PRIstrbsize "\n", sb->p.len, sb->p.pos);
+                sb->p.len = sb->p.pos;
+                buf[n] = '\0';
+            }
+
+#if STRB_RESTORE
+            sb->p.restore_char = buf[n];
+            sb->p.flags |= F_CAN_RESTORE;
+            DEBUGF("Stored %d ('%c') at %" PRIstrbsize "\n", sb->p.restore_char, sb->p.restore_char, sb->p.pos);
+#endif
+
+#if STRB_UNPUTC
+            if (n)
+                sb->p.flags |= F_CAN_UNPUTC;
+#endif
+            return buf;
+        }
+    }
+}
+
+void strb_split(strb_t *sb)
+{
+    _Optional char *p = strb_write(sb, 0); // fails only if a shared buffer can't be copied
+    if (p)
+        *(char *)p = '\0';
+}
+
+#if STRB_RESTORE
+void strb_restore(strb_t *sb)
+{
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+    if ((sb->p.flags & F_CAN_RESTORE) && unshare(sb, sb->p.len + 1)) {
+#if STRB_GAP
+        assert(!sb->p.gap_len);
+#endif
+        DEBUGF("Restored %d ('%c') at %" PRIstrbsize "\n", sb->p.restore_char, sb->p.restore_char, sb->p.pos);
+        sb->p.buf[sb->p.pos] = sb->p.restore_char;
+        sb->p.flags &= ~F_CAN_RESTORE;
+        HASH_CHANGE(sb, sb->p.pos);
+        LINES_CHANGE(sb, sb->p.pos);
+    }
+}
+#endif
+
+void strb_delto(strb_t *sb, size_t pos)
+{
+    strbsize_t hi, lo;
+
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+    assert(sb->p.pos < STRB_MAX_SIZE);
+
+    if (!unshare(sb, sb->p.len + 1))
+        return;
 
     if (sb->p.pos > pos) {
         lo = pos;
@@ -736,29 +3062,344 @@ void strb_delto(strb_t *sb, size_t pos)
     }
     assert(lo <= hi);
 
-    if (!(sb->p.flags & F_OVERWRITE)) {
-        strbsize_t clo, chi, len;
+    if (!(sb->p.flags & F_OVERWRITE)) {
+        strbsize_t clo, chi, len;
+
+        len = sb->p.len;
+        chi = hi > len ? len : hi;
+        clo = lo > len ? len : lo;
+        assert(clo <= chi);
+        HASH_CHANGE(sb, clo);
+        LINES_CHANGE(sb, clo);
+
+#if STRB_GAP
+        if (can_gap(sb)) {
+            // Widen the gap instead of moving the tail
+            if (sb->p.gap_len)
+                move_gap(sb, clo);
+            else
+                sb->p.gap_pos = clo;
+            sb->p.gap_len += chi - clo;
+            if (chi == len) {
+                // Nothing follows the gap, so closing it is free
+                sb->p.gap_len = 0;
+                sb->p.buf[clo] = '\0';
+            }
+        } else
+#endif
+        {
+            memmove(sb->p.buf + clo, sb->p.buf + chi, len + 1 - chi);
+            STAT_ADD(sb, moved, len + 1 - chi);
+        }
+        sb->p.len = len - (chi - clo);
+    }
+
+    sb->p.pos = lo;
+#if STRB_UNPUTC || STRB_RESTORE
+    sb->p.flags &= ~(F_CAN_UNPUTC | F_CAN_RESTORE);
+#endif
+}
+
+// Copy the characters from src to the end of the string down to dst, replacing each
+// occurrence of one string with another that is no longer, and return the new length
+static strbsize_t replace_down(char *buf, strbsize_t dst, strbsize_t src, strbsize_t len,
+                               const char *from, size_t from_len, const char *to, size_t to_len)
+{
+    _Optional const char *found;
+
+    assert(dst <= src);
+    while ((found = find_chars(buf + src, len - src, from, from_len))) {
+        const strbsize_t at = (strbsize_t)(found - buf);
+
+        memmove(buf + dst, buf + src, at - src);
+        dst += at - src;
+        memcpy(buf + dst, to, to_len);
+        dst += to_len;
+        src = at + from_len;
+        assert(dst <= src);
+    }
+    memmove(buf + dst, buf + src, len - src);
+    return dst + (len - src);
+}
+
+size_t strb_replace_all(strb_t *restrict sb, const char *restrict from, const char *restrict to)
+{
+    const size_t from_len = strlen(from), to_len = strlen(to);
+    _Optional const char *found;
+    strbsize_t first, len, src, pos;
+    size_t count = 0, before = 0;
+
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+    assert(sb->p.pos < STRB_MAX_SIZE);
+
+    if (!from_len)
+        return 0;
+
+    // Count the occurrences, which must not overlap
+    close_gap(sb);
+    len = sb->p.len;
+    found = find_chars(sb->p.buf, len, from, from_len);
+    if (!found)
+        return 0;
+
+    // Also count the occurrences before the position, which moves with the text around it
+    // (or to the start of the replacement of an occurrence spanning it)
+    pos = sb->p.pos;
+    first = (strbsize_t)(found - sb->p.buf);
+    for (src = first; found; found = find_chars(sb->p.buf + src, len - src, from, from_len)) {
+        const strbsize_t at = (strbsize_t)(found - sb->p.buf);
+
+        src = at + from_len;
+        if (src <= sb->p.pos)
+            ++before;
+        else if (at < sb->p.pos)
+            pos = at;
+        ++count;
+    }
+    DEBUGF("Replacing %zu occurrences of %zu chars with %zu chars\n", count, from_len, to_len);
+
+    if (to_len > from_len) {
+        // Make room for the longer string once, then move everything after the first
+        // occurrence to the end, so that the result can be built in front of it
+        const size_t extra_each = to_len - from_len;
+        const strbsize_t top = pos > len ? pos : len;
+        strbsize_t extra;
+
+        if (count > (size_t)(STRB_MAX_SIZE - 1 - top) / extra_each) {
+            DEBUGF("Integer range exhausted (len=%" PRIstrbsize ", pos=%" PRIstrbsize
+                   ", count=%zu)\n", len, pos, count);
+            set_err(sb);
+            return 0;
+        }
+        pos += (strbsize_t)(before * extra_each);
+        extra = (strbsize_t)(count * extra_each);
+
+        if (!unshare(sb, len + 1))
+            return 0;
+
+        if (!strb_ensure(sb, extra, len)) {
+            DEBUGF("No room\n");
+            set_err(sb);
+            return 0;
+        }
+
+        memmove(sb->p.buf + first + extra, sb->p.buf + first, len - first);
+        STAT_ADD(sb, moved, len - first);
+        src = first + extra;
+        len += extra;
+    } else {
+        if (!unshare(sb, len + 1))
+            return 0;
+
+        pos -= (strbsize_t)(before * (from_len - to_len));
+        src = first;
+    }
+
+    HASH_CHANGE(sb, first);
+    LINES_CHANGE(sb, first);
+    sb->p.len = replace_down(sb->p.buf, first, src, len, from, from_len, to, to_len);
+    sb->p.buf[sb->p.len] = '\0';
+    STAT_ADD(sb, moved, len - src - count * from_len);
+    assert(sb->p.len < sb->p.size);
+    sb->p.pos = pos;
+
+#if STRB_UNPUTC || STRB_RESTORE
+    sb->p.flags &= ~(F_CAN_UNPUTC | F_CAN_RESTORE);
+#endif
+    return count;
+}
+
+int strb_reserve(strb_t *sb, size_t n)
+{
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+
+    if (n < sb->p.size)
+        return 0;
+
+    if (n >= STRB_MAX_SIZE) {
+        DEBUGF("Can't reserve %zu characters\n", n);
+        return set_err(sb);
+    }
+
+#if STRB_STATIC_ALLOC || STRB_FREESTANDING
+    DEBUGF("Fixed buffer exhausted\n");
+    return set_err(sb);
+#else
+    if (!unshare(sb, sb->p.len + 1))
+        return EOF;
+
+    if (is_external(sb)) {
+        DEBUGF("External buffer exhausted\n");
+        return set_err(sb);
+    }
+
+    close_gap(sb);
+    {
+        // The buffer must also be big enough for the string and position
+        const strbsize_t top = sb->p.pos > sb->p.len ? sb->p.pos : sb->p.len;
+
+        if (!resize(sb, (n > top ? (strbsize_t)n : top) + 1))
+            return set_err(sb);
+    }
+
+    return 0;
+#endif
+}
+
+void strb_shrink_to_fit(strb_t *sb)
+{
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+
+#if STRB_STATIC_ALLOC || STRB_FREESTANDING
+    (void)sb;
+#else
+    if (kind(sb) == KIND_ALLOCATED) {
+        const strbsize_t top = sb->p.pos > sb->p.len ? sb->p.pos : sb->p.len;
+
+        strbsize_t new_size = top + 1;
+
+        if (is_mapped(new_size))
+            new_size = map_size(new_size);
+
+        if (new_size < sb->p.size) {
+            close_gap(sb);
+            {
+                _Optional char *new_buf = buf_realloc(sb->p.buf, sb->p.size, &new_size,
+                                                      sb->p.len + 1);
+                if (new_buf) {
+                    sb->p.buf = new_buf;
+                    sb->p.size = new_size;
+                    STAT_ADD(sb, reallocs, 1);
+                    DEBUGF("Shrunk buffer to %" PRIstrbsize " bytes\n", sb->p.size);
+                }
+            }
+        }
+    }
+#endif
+}
+
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+_Optional char *strb_detach(strb_t *sb, _Optional size_t *len)
+{
+    _Optional char *buf;
+
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+    close_gap(sb);
+    LINES_FREE(sb);
+
+    if (kind(sb) == KIND_ALLOCATED && !is_mapped(sb->p.size)) {
+        // Hand over the heap buffer, first releasing storage if more than half is unused
+        buf = sb->p.buf;
+        if (sb->p.size / 2 > sb->p.len + 1) {
+            _Optional char *const new_buf = realloc(buf, sb->p.len + 1);
+            if (new_buf) {
+                DEBUGF("Shrunk detached buffer from %" PRIstrbsize " to %" PRIstrbsize "\n",
+                       sb->p.size, sb->p.len + 1);
+                buf = new_buf;
+            }
+        }
+    } else {
+        // Copy the string out of an internal, external, shared or mapped buffer
+        buf = malloc(sb->p.len + 1);
+        if (!buf) {
+            set_err(sb);
+            return NULL;
+        }
+        memcpy(buf, sb->p.buf, sb->p.len + 1);
+        DEBUGF("Copied %" PRIstrbsize " chars to detach them\n", sb->p.len);
+        if (is_shared(sb))
+            release_shared(sb);
+#if STRB_MMAP
+        else if (kind(sb) == KIND_ALLOCATED)
+            buf_free(sb->p.buf, sb->p.size);
+#endif
+    }
+
+    if (len)
+        *len = sb->p.len;
+
+    if (frees_object(sb))
+        free_metadata(sb);
+
+    return buf;
+}
+
+_Optional strb_t *strb_adopt(char *buf, size_t size, size_t len)
+{
+    _Optional strb_t *sb;
+
+    assert(buf);
+    assert(len < size);
+    assert(buf[len] == '\0');
+    DEBUGF("Adopt buffer %p of size %zu\n", buf, size);
+
+    if (size > STRB_MAX_SIZE)
+        size = STRB_MAX_SIZE;
 
-        len = sb->p.len;
-        chi = hi > len ? len : hi;
-        clo = lo > len ? len : lo;
-        assert(clo <= chi);
+    if (len >= size)
+        return NULL;
 
-        memmove(sb->p.buf + clo, sb->p.buf + chi, len + 1 - chi);
-        sb->p.len = len - (chi - clo);
+    // Nothing can fail after the string is moved, because the caller's buffer is then freed
+    sb = alloc_metadata(0);
+    if (!sb)
+        return NULL;
+
+#if STRB_MMAP
+    if (is_mapped(size)) {
+        // Sizes that would imply a mapping are understated, or the string is moved
+        if (!is_mapped(len + 1)) {
+            size = STRB_MMAP_THRESHOLD - 1;
+        } else {
+            strbsize_t new_size = len + 1;
+            _Optional char *const new_buf = buf_alloc(&new_size);
+            if (!new_buf) {
+                free_metadata(sb);
+                return NULL;
+            }
+            memcpy(new_buf, buf, len + 1);
+            free(buf);
+            buf = new_buf;
+            size = new_size;
+        }
     }
+#endif
 
-    sb->p.pos = lo;
-#if STRB_UNPUTC || STRB_RESTORE
-    sb->p.flags &= ~(F_CAN_UNPUTC | F_CAN_RESTORE);
+    sb->p.len = sb->p.pos = len;
+    sb->p.size = size;
+    sb->p.buf = buf;
+    sb->p.flags = KIND_ALLOCATED;
+#if STRB_GAP
+    sb->p.gap_pos = sb->p.gap_len = 0;
+#endif
+    STAT_INIT(&sb->p);
+    HASH_INIT(&sb->p);
+    LINES_INIT(&sb->p);
+
+#if STRB_UNPUTC
+    if (len)
+        sb->p.flags |= F_CAN_UNPUTC;
 #endif
+    return sb;
 }
+#endif // !STRB_STATIC_ALLOC && !STRB_FREESTANDING
 
 static void strb_empty(strb_t *sb)
 {
     assert(sb);
     assert(!(sb->p.flags & F_IS_CONST));
+    if (!unshare(sb, 0))
+        return;
+
     sb->p.len = sb->p.pos = 0;
+    HASH_INIT(&sb->p);
+    LINES_CHANGE(sb, 0);
+#if STRB_GAP
+    sb->p.gap_len = 0;
+#endif
     sb->p.buf[0] = '\0';
 #if STRB_UNPUTC || STRB_RESTORE
     sb->p.flags &= ~(F_CAN_UNPUTC | F_CAN_RESTORE);
@@ -777,7 +3418,7 @@ int strb_cpy(strb_t *restrict sb,
     return strb_ncpy(sb, str, SIZE_MAX);
 }
 
-#if !STRB_FREESTANDING
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
 
 int strb_vprintf(strb_t *restrict sb, const char *restrict format, va_list args)
 {
@@ -796,8 +3437,624 @@ int strb_printf(strb_t *restrict sb, const char *restrict format, ...)
     }
 }
 
+#endif // !STRB_FREESTANDING || STRB_NATIVE_FMT
+
+#if !STRB_FREESTANDING
+// Get the characters of a string as one or two contiguous segments, without
+// closing any gap. Returns the number of segments.
+static int segments(strb_t const *sb, const char *seg[2], size_t seg_len[2])
+{
+    assert(sb);
+    seg[0] = sb->p.buf;
+#if STRB_GAP
+    if (sb->p.gap_len && sb->p.gap_pos < sb->p.len) {
+        seg_len[0] = sb->p.gap_pos;
+        seg[1] = sb->p.buf + sb->p.gap_pos + sb->p.gap_len;
+        seg_len[1] = sb->p.len - sb->p.gap_pos;
+        return 2;
+    }
+#endif
+    seg_len[0] = sb->p.len;
+    return 1;
+}
+
+int strb_fwrite(strb_t const *sb, FILE *stream)
+{
+    const char *seg[2];
+    size_t seg_len[2];
+    int i, nseg;
+
+    assert(stream);
+    nseg = segments(sb, seg, seg_len);
+    for (i = 0; i < nseg; ++i) {
+        if (fwrite(seg[i], 1, seg_len[i], stream) != seg_len[i])
+            return EOF;
+    }
+    return 0;
+}
+#endif
+
+#if STRB_POSIX
+/** Maximum number of segments gathered by one call to writev */
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define WRITEV_MAX IOV_MAX
+#else
+#define WRITEV_MAX 256
+#endif
+
+// Write all of the given segments, retrying after partial writes and interruptions.
+// The array of segments is modified.
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            DEBUGF("writev failed\n");
+            return EOF;
+        }
+        DEBUGF("Wrote %zd bytes of %d segments\n", n, iovcnt);
+
+        // Skip segments written completely, then advance into a partially written one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+int strb_write_fd(strb_t const *sb, int fd)
+{
+    return strb_writev_fd(fd, (strb_t *const *)&sb, 1);
+}
+
+int strb_writev_fd(int fd, strb_t *const sbs[], size_t n)
+{
+    struct iovec iov[WRITEV_MAX];
+    int iovcnt = 0;
+    size_t i;
+
+    assert(sbs || !n);
+    for (i = 0; i < n; ++i) {
+        const char *seg[2];
+        size_t seg_len[2];
+        int j, nseg = segments(sbs[i], seg, seg_len);
+
+        if (iovcnt > WRITEV_MAX - 2) {
+            if (writev_all(fd, iov, iovcnt))
+                return EOF;
+            iovcnt = 0;
+        }
+        for (j = 0; j < nseg; ++j) {
+            if (seg_len[j]) {
+                iov[iovcnt].iov_base = (char *)seg[j];
+                iov[iovcnt].iov_len = seg_len[j];
+                ++iovcnt;
+            }
+        }
+    }
+    return writev_all(fd, iov, iovcnt);
+}
+#endif // STRB_POSIX
+
+#if STRB_FOPEN
+static ssize_t cookie_read(void *cookie, char *buf, size_t size)
+{
+    strb_t *const sb = cookie;
+    size_t n = 0;
+
+    if (sb->p.pos < sb->p.len) {
+        n = sb->p.len - sb->p.pos;
+        if (n > size)
+            n = size;
+        memcpy(buf, strb_cptr(sb) + sb->p.pos, n);
+        strb_seek(sb, sb->p.pos + n);
+    }
+    return (ssize_t)n;
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size)
+{
+    strb_t *const sb = cookie;
+    _Optional char *dest = put_write(sb, size);
+    if (!dest)
+        return 0; // the stream's error indicator is set
+
+    memcpy(dest, buf, size);
+    return (ssize_t)size;
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+    strb_t *const sb = cookie;
+    off64_t base;
+
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = (off64_t)sb->p.pos;
+        break;
+    case SEEK_END:
+        base = (off64_t)sb->p.len;
+        break;
+    default:
+        return -1;
+    }
+
+    if (*offset < -base ||
+        (*offset > 0 && (uintmax_t)*offset >= (uintmax_t)STRB_MAX_SIZE - (uintmax_t)base)) {
+        DEBUGF("Bad stream seek %jd from %jd\n", (intmax_t)*offset, (intmax_t)base);
+        return -1;
+    }
+
+    *offset += base;
+    return strb_seek(sb, (size_t)*offset) ? -1 : 0;
+}
+
+_Optional FILE *strb_fopen(strb_t *sb, const char *mode)
+{
+    static const cookie_io_functions_t funcs = {
+        .read = cookie_read, .write = cookie_write, .seek = cookie_seek, .close = NULL
+    };
+    _Optional FILE *stream;
+
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+    assert(mode);
+
+    stream = fopencookie(sb, mode, funcs);
+    DEBUGF("Opened stream %p for %p\n", (void *)stream, (void *)sb);
+    return stream;
+}
+#endif // STRB_FOPEN
+
+#if !STRB_FREESTANDING
+/** Number of characters to make room for, or read into a temporary array, at a time */
+#define READ_CHUNK 4096
+
+/**
+ * Function to read up to n characters into dest. Returns the number of characters read,
+ * zero at the end of the input, or a negative value on error.
+ */
+typedef ptrdiff_t read_fn(void *src, char *dest, size_t n);
+
+// Common implementation of strb_fread and strb_read_fd. Characters are read
+// straight into free space at the end of the string when possible.
+static int read_into(strb_t *sb, read_fn *fn, void *src, size_t max)
+{
+    size_t total = 0;
+
+    assert(sb);
+    assert(!(sb->p.flags & F_IS_CONST));
+    if (!unshare(sb, sb->p.len + 1))
+        return EOF;
+
+    while (total < max) {
+        const size_t want = max - total < READ_CHUNK ? max - total : READ_CHUNK;
+        ptrdiff_t n;
+
+        if (sb->p.pos == sb->p.len) {
+            close_gap(sb);
+            if (sb->p.size - 1 == sb->p.len) {
+                // The buffer is full (perhaps sized to fit), so only grow it if there
+                // is more to read
+                char probe;
+
+                n = fn(src, &probe, 1);
+                if (n > 0) {
+                    _Optional char *buf;
+
+                    // Fall back to room for the probe alone (e.g. near the maximum size)
+                    if (!strb_ensure(sb, want, sb->p.len) && !strb_ensure(sb, 1, sb->p.len)) {
+                        DEBUGF("No room\n");
+                        return set_err(sb);
+                    }
+                    buf = put_write(sb, 1); // can't fail or substitute another buffer
+                    assert(buf);
+                    *(char *)buf = probe;
+                }
+            } else {
+                char *start;
+                size_t room;
+
+                if ((size_t)(sb->p.size - 1 - sb->p.len) < want)
+                    (void)strb_ensure(sb, want, sb->p.len); // else use whatever room is left
+
+                room = sb->p.size - 1 - sb->p.len;
+                if (room > max - total)
+                    room = max - total;
+                if (room > PTRDIFF_MAX)
+                    room = PTRDIFF_MAX;
+
+                start = sb->p.buf + sb->p.len;
+                n = fn(src, start, room);
+                if (n > 0) {
+                    const char first = *start;
+                    *start = '\0'; // strb_write expects the original terminator when appending
+                    start = put_write(sb, (size_t)n); // can't fail or substitute another buffer
+                    assert(start == sb->p.buf + sb->p.len - n);
+                    *start = first;
+                }
+            }
+        } else {
+            // Characters must be inserted or overwritten in the middle of the string
+            char chunk[READ_CHUNK];
+
+            n = fn(src, chunk, want);
+            if (n > 0) {
+                _Optional char *buf = put_write(sb, (size_t)n);
+                if (!buf)
+                    return EOF;
+
+                memcpy(buf, chunk, (size_t)n);
+            }
+        }
+
+        if (n < 0)
+            return EOF;
+
+        if (!n)
+            break;
+
+        total += (size_t)n;
+    }
+    DEBUGF("Read %zu chars\n", total);
+    return 0;
+}
+
+static ptrdiff_t read_stream(void *src, char *dest, size_t n)
+{
+    FILE *const stream = src;
+    const size_t got = fread(dest, 1, n, stream);
+    return !got && ferror(stream) ? -1 : (ptrdiff_t)got;
+}
+
+int strb_fread(strb_t *sb, FILE *stream, size_t max)
+{
+    assert(stream);
+    return read_into(sb, read_stream, stream, max);
+}
+
+#if STRB_POSIX
+static ptrdiff_t read_fd(void *src, char *dest, size_t n)
+{
+    const int fd = *(int *)src;
+    ssize_t got;
+
+    do {
+        got = read(fd, dest, n);
+    } while (got < 0 && errno == EINTR);
+    return got;
+}
+
+int strb_read_fd(strb_t *sb, int fd, size_t max)
+{
+    return read_into(sb, read_fd, &fd, max);
+}
+#endif
+
+int strb_readfile(strb_t *sb, const char *path)
+{
+    int err;
+
+    assert(sb);
+    assert(path);
+    {
+#if STRB_POSIX
+        struct stat st;
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
+            DEBUGF("Can't open %s\n", path);
+            return EOF;
+        }
+
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+            // Make room for the whole file at once, or fail before reading anything
+            const strbsize_t top = (sb->p.flags & F_OVERWRITE) || sb->p.pos > sb->p.len ?
+                                   sb->p.pos : sb->p.len;
+            close_gap(sb);
+            if ((uintmax_t)st.st_size >= SIZE_MAX ||
+                !strb_ensure(sb, (size_t)st.st_size, top)) {
+                DEBUGF("No room for %s\n", path);
+                close(fd);
+                return set_err(sb);
+            }
+        }
+
+        err = strb_read_fd(sb, fd, SIZE_MAX);
+        close(fd);
+#else
+        FILE *const stream = fopen(path, "rb");
+
+        if (!stream) {
+            DEBUGF("Can't open %s\n", path);
+            return EOF;
+        }
+
+        err = strb_fread(sb, stream, SIZE_MAX);
+        fclose(stream);
+#endif
+    }
+    return err;
+}
 #endif // !STRB_FREESTANDING
 
+#if !STRB_FREESTANDING && STRB_EXT_STATE
+typedef struct {
+    uint64_t hash;
+    _Optional strbstate_t *entry; // null if the slot is empty
+} intern_slot_t;
+
+#if !STRB_STATIC_ALLOC
+typedef struct intern_chunk_t {
+    _Optional struct intern_chunk_t *next;
+    strbstate_t units[]; // string buffer states, each followed by its string
+} intern_chunk_t;
+
+#define INTERN_CHUNK_UNITS \
+    ((STRB_INTERN_CHUNK_SIZE - sizeof(intern_chunk_t)) / sizeof(strbstate_t))
+#define INTERN_MIN_SLOTS (16)
+#endif
+
+// Strings are allocated in units of the size of a string buffer state, so that each
+// state is aligned. The slots are an open-addressing hash table with linear probing,
+// which is never more than half full.
+struct strbintern_t {
+    size_t count;       // number of strings
+    size_t mask;        // number of slots minus one
+    size_t used, avail; // number of units used and available in the current chunk
+#if STRB_STATIC_ALLOC
+    intern_slot_t slots[STRB_INTERN_MAX * 2];
+    strbstate_t arena[STRB_INTERN_ARENA_SIZE / sizeof(strbstate_t)];
+#else
+    intern_slot_t *slots;
+    _Optional intern_chunk_t *chunks; // current chunk first
+#endif
+};
+
+#if STRB_STATIC_ALLOC && STRB_INTERN_TABLES
+_Static_assert(STRB_INTERN_TABLES <= 8, "Too many intern tables");
+_Static_assert(!(STRB_INTERN_MAX & (STRB_INTERN_MAX - 1)), "Intern table size not a power of two");
+static strbintern_t tables[STRB_INTERN_TABLES];
+static uint8_t table_map;
+#endif
+
+_Optional strbintern_t *strb_intern_alloc(void)
+{
+    _Optional strbintern_t *table = NULL;
+
+#if STRB_STATIC_ALLOC && !STRB_INTERN_TABLES
+    DEBUGF("No intern tables configured\n");
+    return NULL;
+#elif STRB_STATIC_ALLOC
+    int i;
+
+    for (i = 0; i < STRB_INTERN_TABLES; ++i) {
+        if (!(table_map & (1u << i))) {
+            table_map |= 1u << i;
+            table = &tables[i];
+            break;
+        }
+    }
+    if (!table) {
+        DEBUGF("No free intern table\n");
+        return NULL;
+    }
+
+    memset(table->slots, 0, sizeof(table->slots));
+    table->mask = STRB_INTERN_MAX * 2 - 1;
+    table->avail = sizeof(table->arena) / sizeof(table->arena[0]);
+#else
+    table = malloc(sizeof(*table));
+    if (!table)
+        return NULL;
+
+    table->slots = calloc(INTERN_MIN_SLOTS, sizeof(*table->slots));
+    if (!table->slots) {
+        free(table);
+        return NULL;
+    }
+    table->mask = INTERN_MIN_SLOTS - 1;
+    table->avail = 0;
+    table->chunks = NULL;
+#endif
+    table->count = table->used = 0;
+    DEBUGF("Created intern table %p\n", (void *)table);
+    return table;
+}
+
+void strb_intern_free(_Optional strbintern_t *table)
+{
+    if (!table)
+        return;
+
+    DEBUGF("Free intern table %p of %zu strings\n", (void *)table, table->count);
+#if STRB_STATIC_ALLOC && !STRB_INTERN_TABLES
+    assert(!"No intern tables configured");
+#elif STRB_STATIC_ALLOC
+    {
+        const ptrdiff_t idx = table - tables;
+        assert(idx >= 0);
+        assert(idx < STRB_INTERN_TABLES);
+        table_map &= ~(1u << idx);
+    }
+#else
+    while (table->chunks) {
+        intern_chunk_t *const chunk = table->chunks;
+        table->chunks = chunk->next;
+        free(chunk);
+    }
+    free(table->slots);
+    free(table);
+#endif
+}
+
+// Allocate contiguous units for a string buffer state and its string
+static _Optional strbstate_t *intern_units(strbintern_t *table, size_t units)
+{
+    strbstate_t *entry;
+
+    if (units > table->avail - table->used) {
+#if STRB_STATIC_ALLOC
+        DEBUGF("Intern table arena exhausted\n");
+        return NULL;
+#else
+        const size_t chunk_units = units > INTERN_CHUNK_UNITS ? units : INTERN_CHUNK_UNITS;
+        _Optional intern_chunk_t *const chunk =
+            malloc(sizeof(*chunk) + chunk_units * sizeof(chunk->units[0]));
+
+        if (!chunk)
+            return NULL;
+
+        if (chunk_units > INTERN_CHUNK_UNITS && table->chunks) {
+            // Keep allocating from the current chunk after a long string
+            chunk->next = table->chunks->next;
+            table->chunks->next = chunk;
+            return chunk->units;
+        }
+
+        chunk->next = table->chunks;
+        table->chunks = chunk;
+        table->used = 0;
+        table->avail = chunk_units;
+#endif
+    }
+
+#if STRB_STATIC_ALLOC
+    entry = &table->arena[table->used];
+#else
+    entry = &table->chunks->units[table->used];
+#endif
+    table->used += units;
+    return entry;
+}
+
+#if !STRB_STATIC_ALLOC
+// Double the number of slots
+static bool intern_grow(strbintern_t *table)
+{
+    const size_t nslots = (table->mask + 1) * 2;
+    _Optional intern_slot_t *const slots = calloc(nslots, sizeof(*slots));
+    size_t i, j;
+
+    if (!slots)
+        return false;
+
+    for (i = 0; i <= table->mask; ++i) {
+        if (!table->slots[i].entry)
+            continue;
+
+        for (j = table->slots[i].hash & (nslots - 1); slots[j].entry; j = (j + 1) & (nslots - 1))
+            ;
+        slots[j] = table->slots[i];
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->mask = nslots - 1;
+    DEBUGF("Grew intern table %p to %zu slots\n", (void *)table, nslots);
+    return true;
+}
+#endif
+
+_Optional const strb_t *strb_intern(strbintern_t *restrict table, const char *restrict str,
+                                    size_t len)
+{
+    const size_t nwords = len / sizeof(uint64_t);
+    uint64_t words_hash, hash;
+    size_t i;
+
+    assert(table);
+    assert(str);
+
+    if (len >= STRB_MAX_SIZE || len > SIZE_MAX / 2) {
+        DEBUGF("Can't intern %zu characters\n", len);
+        return NULL;
+    }
+
+    // Same as strb_hash, which can reuse the hash of the whole words
+    words_hash = hash_words(HASH_SEED, str, nwords);
+    hash = hash_finish(words_hash, str + nwords * sizeof(uint64_t), len);
+    for (i = (size_t)hash & table->mask; table->slots[i].entry; i = (i + 1) & table->mask) {
+        const strbstate_t *const entry = table->slots[i].entry;
+
+        if (table->slots[i].hash == hash && entry->p.len == len &&
+            !memcmp(entry->p.buf, str, len))
+            return (const strb_t *)(const void *)entry;
+    }
+
+    // Not found, so add the string in the empty slot that ended the search
+#if STRB_STATIC_ALLOC
+    if (table->count == STRB_INTERN_MAX) {
+        DEBUGF("Intern table full\n");
+        return NULL;
+    }
+#else
+    if ((table->count + 1) * 2 > table->mask + 1) {
+        if (!intern_grow(table))
+            return NULL;
+
+        for (i = (size_t)hash & table->mask; table->slots[i].entry; i = (i + 1) & table->mask)
+            ;
+    }
+#endif
+
+    {
+        // The characters (and a terminator) follow the state, in as many units as needed
+        _Optional strbstate_t *const entry =
+            intern_units(table, 1 + (len + sizeof(strbstate_t)) / sizeof(strbstate_t));
+        char *buf;
+        strb_t *sb;
+
+        if (!entry)
+            return NULL;
+
+        buf = (char *)(entry + 1);
+        memcpy(buf, str, len);
+        buf[len] = '\0';
+        sb = init_use(entry, (strbsize_t)len + 1, buf, (strbsize_t)len);
+        set_kind(sb, KIND_INTERNED);
+#ifndef NDEBUG
+        sb->p.flags |= F_IS_CONST;
+#endif
+#if STRB_HASH
+        entry->p.hash = words_hash;
+        entry->p.hashed = (strbsize_t)(nwords * sizeof(uint64_t));
+#endif
+        table->slots[i].hash = hash;
+        table->slots[i].entry = entry;
+        ++table->count;
+        DEBUGF("Interned %zu characters at %p\n", len, (void *)buf);
+        return sb;
+    }
+}
+#endif // !STRB_FREESTANDING && STRB_EXT_STATE
+
+#if STRB_STATS
+void strb_getstats(strb_t const *sb, strbstats_t *out)
+{
+    assert(sb);
+    assert(out);
+    *out = sb->p.stats;
+}
+
+void strb_gettotalstats(strbstats_t *out)
+{
+    assert(out);
+    *out = totals;
+}
+#endif
+
 bool strb_error(strb_t const *sb )
 {
     assert(sb);
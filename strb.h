@@ -14,6 +14,10 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
+#if !STRB_FREESTANDING
+#include <stdio.h>
+#endif
 
 /**
  * Whether the interface has user-allocated string buffer state objects.
@@ -82,6 +86,26 @@ typedef uint8_t strbsize_t;
  */
 #define STRB_MAX_SIZE (256-8)
 
+/**
+ * Maximum number of tables created by @ref strb_intern_alloc that can exist at once.
+ * Each table is reserved in static storage, so there are none unless this is defined
+ * (as at most 8) when building.
+ */
+#ifndef STRB_INTERN_TABLES
+#define STRB_INTERN_TABLES (0)
+#endif
+
+/**
+ * Maximum number of distinct strings in each table created by @ref strb_intern_alloc.
+ */
+#define STRB_INTERN_MAX (16)
+
+/**
+ * Size, in bytes, of the storage for the strings in each table created by
+ * @ref strb_intern_alloc, including the state of their string buffer objects.
+ */
+#define STRB_INTERN_ARENA_SIZE (512)
+
 /**
  * Macro used to suppress variably modified types in parameter lists.
  */
@@ -94,6 +118,37 @@ typedef uint8_t strbsize_t;
  */
 #define STRB_MAX SIZE_MAX
 
+#if STRB_LARGE
+// Strings limited only by the address space
+/**
+ * Type capable of representing all supported character positions and buffer sizes.
+ */
+typedef size_t strbsize_t;
+
+/**
+ * Macro to be used to print values of type @ref strbsize_t
+ */
+#define PRIstrbsize "zu"
+
+/**
+ * Maximum string size, in characters (including null terminator).
+ */
+#define STRB_MAX_SIZE SIZE_MAX
+
+#ifdef __linux__
+/**
+ * Whether buffers of at least @ref STRB_MMAP_THRESHOLD characters are mapped directly
+ * from the operating system and grown by remapping their pages instead of copying them.
+ */
+#define STRB_MMAP 1
+#endif
+
+/**
+ * Minimum buffer size, in characters, for buffers to be mapped if STRB_MMAP is defined.
+ */
+#define STRB_MMAP_THRESHOLD ((size_t)1 << 25)
+
+#else
 /**
  * Type capable of representing all supported character positions and buffer sizes.
  */
@@ -108,17 +163,47 @@ typedef uint16_t strbsize_t;
  * Maximum string size, in characters (including null terminator).
  */
 #define STRB_MAX_SIZE UINT16_MAX
+#endif
 
 /**
- * Buffer size, in characters, substituted by @ref strb_alloc when the requested size is too small.
+ * Buffer size, in characters, substituted by @ref strb_alloc when no size is requested.
  */
 #define STRB_DFL_SIZE (256)
 
+/**
+ * Minimum buffer size, in characters, allocated as part of a @ref strb_t object.
+ * Internal buffers are allocated in size classes that are powers of two multiples of this.
+ */
+#define STRB_MIN_INTERNAL_SIZE (16)
+
 /**
  * Maximum buffer size, in characters, allocated as part of a @ref strb_t object rather than separately.
  */
 #define STRB_MAX_INTERNAL_SIZE (256)
 
+/**
+ * Size, in bytes, of each block of storage from which @ref strb_t objects are
+ * allocated if STRB_SLAB is defined.
+ */
+#define STRB_SLAB_SIZE (16384)
+
+/**
+ * Size, in bytes, of each block of storage from which tables created by
+ * @ref strb_intern_alloc allocate strings and their string buffer objects.
+ * Longer strings are allocated separately.
+ */
+#define STRB_INTERN_CHUNK_SIZE (4096)
+
+/**
+ * Whether the interface provides the @ref strb_seekline and @ref strb_lineof functions.
+ */
+#define STRB_LINES 1
+
+/**
+ * Whether the interface provides the @ref strb_hash function.
+ */
+#define STRB_HASH 1
+
 /**
  * Macro used to suppress variably modified types in parameter lists.
  */
@@ -131,6 +216,20 @@ typedef uint16_t strbsize_t;
 
 #endif
 
+#if !STRB_FREESTANDING && !defined(STRB_POSIX) && (defined(__unix__) || defined(__APPLE__))
+/**
+ * Whether functions that operate on POSIX file descriptors are available.
+ */
+#define STRB_POSIX 1
+#endif
+
+#if !STRB_FREESTANDING && !defined(STRB_FOPEN) && defined(__GLIBC__)
+/**
+ * Whether @ref strb_fopen is available.
+ */
+#define STRB_FOPEN 1
+#endif
+
 /**
  * Qualifier indicating optional objects
  *
@@ -150,6 +249,25 @@ typedef uint16_t strbsize_t;
  */
 typedef struct strb_t strb_t;
 
+#if STRB_STATS
+/**
+ * @brief Statistics about operations on string buffers
+ *
+ * Counters recorded if STRB_STATS is defined, either for one string buffer or for
+ * all string buffers in the process. Counters wrap around if they overflow.
+ */
+typedef struct {
+    /** Number of buffers substituted to make room or release unused storage */
+    unsigned long long reallocs;
+    /** Number of characters moved to make room or close up after deletion */
+    unsigned long long moved;
+    /** Number of characters zero-filled because of writing beyond the end */
+    unsigned long long zeroed;
+    /** Number of passes over a format string, including any repeated to measure the output */
+    unsigned long long formats;
+} strbstats_t;
+#endif
+
 /**
  * @private
  */
@@ -162,9 +280,58 @@ typedef struct {
 #endif
     char flags;
     strbsize_t len, size, pos;
+#if STRB_GAP
+    strbsize_t gap_pos, gap_len;
+#endif
     char *buf;
+#if STRB_HASH
+    uint64_t hash;
+    strbsize_t hashed;
+#endif
+#if STRB_LINES
+    struct strblines_t *lines;
+#endif
+#if STRB_STATS
+    strbstats_t stats;
+#endif
 } strbprivate_t;
 
+/**
+ * @private
+ * Flags stored in strbprivate_t. The state is the first member of every string buffer
+ * object, which allows functions defined in this header to access it.
+ */
+#if STRB_UNPUTC
+#define STRB_PRIVATE_CAN_UNPUTC (1<<0)
+#else
+#define STRB_PRIVATE_CAN_UNPUTC 0
+#endif
+#if STRB_RESTORE
+#define STRB_PRIVATE_CAN_RESTORE (1<<2)
+#else
+#define STRB_PRIVATE_CAN_RESTORE 0
+#endif
+#define STRB_PRIVATE_OVERWRITE (1<<3)
+#if STRB_REUSE_CONST
+#define STRB_PRIVATE_IS_CONST (1<<7)
+#else
+#define STRB_PRIVATE_IS_CONST 0
+#endif
+
+/**
+ * @private
+ * Whether characters can be appended to a string buffer without calling @ref strb_write.
+ */
+#if STRB_GAP
+#define STRB_PRIVATE_CAN_APPEND(p) \
+    (!((p)->flags & (STRB_PRIVATE_OVERWRITE | STRB_PRIVATE_IS_CONST)) && \
+     (p)->pos == (p)->len && !(p)->gap_len)
+#else
+#define STRB_PRIVATE_CAN_APPEND(p) \
+    (!((p)->flags & (STRB_PRIVATE_OVERWRITE | STRB_PRIVATE_IS_CONST)) && \
+     (p)->pos == (p)->len)
+#endif
+
 #if STRB_EXT_STATE
 
 /**
@@ -288,6 +455,38 @@ _Optional strb_t *strb_reuse(strbstate_t *restrict sbs, size_t size, char buf[ST
  * @post If successful, a call to @ref strb_error will return false.
  */
 _Optional const strb_t *strb_reuse_const(strbstate_t *restrict sbs, const char buf[STRB_SIZE_HINT(1)]);
+
+#if STRB_POSIX
+/**
+ * @brief Create a string buffer object that wraps a file mapped into memory
+ *
+ * Maps the file named by @p path into memory read-only and initialises a string buffer
+ * object to wrap its contents, without reading or copying them. The caller must pass a
+ * string buffer state object to be used to store information about the buffer. The mapped
+ * characters are followed by a null character even if the file does not end with one.
+ *
+ * The string length is the size of the file, which must be less than @ref STRB_MAX_SIZE minus one.
+ * Any null characters in the file are part of the string. Pages of the file are only read
+ * when the string is accessed.
+ *
+ * If successful, the created string buffer object is immutable (as indicated by its
+ * qualified type), as for @ref strb_reuse_const. Unlike other string buffer objects with
+ * external state, it must be destroyed by passing its address to @ref strb_free (with the
+ * qualifier cast away), which unmaps the file.
+ *
+ * @param[out] sbs   String buffer state.
+ * @param[in]  path  Name of the file to be mapped.
+ *
+ * @return Address of the created string buffer object, or a null pointer on failure.
+ * @post The created string buffer object becomes invalid if the storage for @p sbs is
+ *       deallocated or the @p sbs object is modified.
+ * @post If the file is truncated while mapped, accessing characters beyond its new end
+ *       may raise a signal.
+ * @post If successful, @ref strb_tell and @ref strb_len return the size of the file.
+ * @post If successful, a call to @ref strb_error will return false.
+ */
+_Optional const strb_t *strb_map_file(strbstate_t *restrict sbs, const char *path);
+#endif
 #endif
 
 #elif !STRB_FREESTANDING
@@ -472,13 +671,41 @@ _Optional strb_t *strb_aprintf(const char *restrict format, ...);
  */
 _Optional strb_t *strb_vaprintf(const char *restrict format, va_list args);
 
+/**
+ * @brief Create a string buffer object with internal storage holding a copy of a string.
+ *
+ * Allocates storage for a string buffer object, initialises it with the string stored in
+ * @p sb, and returns its address. If storage allocation fails, a null pointer is returned.
+ *
+ * If the string in @p sb is stored in an internally allocated buffer, that buffer may be
+ * shared by both string buffer objects (and any other clones) instead of being copied.
+ * The first call that modifies either string, or that calls @ref strb_ptr, gives it a
+ * private copy of the buffer. Use @ref strb_cptr to read a string without copying it.
+ * Sharing is not thread-safe, even between objects that are each used by only one thread.
+ *
+ * @param[in] sb  String buffer to copy.
+ *
+ * @return Address of the created string buffer object, or a null pointer on failure.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf, @ref strb_vaprintf
+ *       or @ref strb_clone.
+ * @post The user is responsible for calling @ref strb_free to free the string buffer object.
+ * @post If successful, @ref strb_tell and @ref strb_len return the length of the string.
+ * @post If successful, the last character of the string (if any) can be removed by
+ *       @ref strb_unputc.
+ * @post If successful, a call to @ref strb_error will return false until an error occurs.
+ */
+_Optional strb_t *strb_clone(strb_t const *sb);
+
 /**
  * @brief Destroy a string buffer object.
  *
  * The associated buffer is also automatically freed, except in the case where its address
  * was passed as a parameter to @ref strb_use or @ref strb_reuse. This must be enforced
  * because storage allocation is abstracted. To pass an internally allocated string to code
- * that needs to take ownership of it, it must first be copied (e.g., using @c strdup).
+ * that needs to take ownership of it, use @ref strb_detach instead.
+ *
+ * Any index of lines built by @ref strb_seekline or @ref strb_lineof is also freed.
  *
  * May be called with a null pointer, in which case this function has no effect.
  *
@@ -488,7 +715,101 @@ _Optional strb_t *strb_vaprintf(const char *restrict format, va_list args);
  * @post @p sb is invalid for use with any function.
  */
 void strb_free(_Optional strb_t *sb);
-#endif
+
+#if !STRB_STATIC_ALLOC
+/**
+ * @brief Destroy a string buffer object but keep its string.
+ *
+ * Transfers ownership of the string in a buffer to the caller, then destroys the string
+ * buffer object as if by calling @ref strb_free. If the string is already stored in a
+ * separately allocated buffer that can be passed to @c free, that buffer is returned without
+ * copying the string, after releasing any large amount of unused storage at its end. Otherwise
+ * (for example, if the string is stored in an internal buffer or a character array passed to
+ * @ref strb_use), the string is copied into a newly allocated buffer.
+ *
+ * @param[in]  sb   String buffer to destroy.
+ * @param[out] len  Optional object in which to store the string length.
+ *
+ * @return Address of the string, which the caller must pass to @c free, or a null pointer
+ *         if storage allocation failed.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf, @ref strb_vaprintf
+ *       or @ref strb_adopt.
+ * @post If successful, @p sb is invalid for use with any function.
+ * @post On failure, the string buffer is unchanged and a call to @ref strb_error will
+ *       return true until @ref strb_clearerr has been called.
+ */
+_Optional char *strb_detach(strb_t *sb, _Optional size_t *len);
+
+/**
+ * @brief Create a string buffer object that takes ownership of an allocated string
+ *
+ * Allocates storage for a string buffer object, initialises it to manage the array
+ * designated by @p buf, and returns its address. The array is not copied. It is
+ * subsequently enlarged or freed as if it had been allocated by the string buffer object,
+ * so it must have been allocated by @c malloc, @c calloc or @c realloc. (The only exception
+ * is that a string too long to be kept in a heap buffer if STRB_MMAP is defined is moved
+ * into a mapped buffer.)
+ *
+ * @param[in] buf   An allocated array of at least @p size characters, whose element at
+ *                  index @p len is a null character.
+ * @param     size  Size of the array, in characters.
+ * @param     len   Length of the string in the array.
+ *
+ * @return Address of the created string buffer object, or a null pointer on failure.
+ * @post If successful, the string buffer object owns @p buf and the user is responsible for
+ *       calling @ref strb_free (or @ref strb_detach) to free the string buffer object.
+ * @post On failure, the caller retains ownership of @p buf.
+ * @post If successful, @ref strb_tell and @ref strb_len return @p len.
+ * @post If successful, the last character of the string (if any) can be removed by
+ *       @ref strb_unputc.
+ * @post If successful, a call to @ref strb_error will return false until an error occurs.
+ */
+_Optional strb_t *strb_adopt(char *buf, size_t size, size_t len);
+
+/**
+ * @brief Policy for growing internal buffers
+ *
+ * Controls the size of the buffer substituted when an internal buffer has insufficient
+ * space for a write. A buffer is never grown by less than the amount needed for the write.
+ */
+typedef struct {
+    /**
+     * New buffer size as a percentage of the old size, e.g. 200 to double the size.
+     * Values not greater than 100 make each buffer just big enough for the write.
+     */
+    unsigned int percent;
+    /**
+     * Maximum number of characters by which to enlarge a buffer in one step, or 0 for no
+     * limit. A buffer is still grown by as much as is needed for the write.
+     */
+    size_t max_step;
+    /**
+     * Granularity, in characters, to which new buffer sizes are rounded up (e.g. the page size),
+     * or 0 for none.
+     */
+    size_t granularity;
+} strbgrowth_t;
+
+/**
+ * @brief Set the policy for growing internal buffers
+ *
+ * The policy applies to all string buffer objects. It is not thread-safe to call this
+ * function while other threads are operating on string buffer objects.
+ *
+ * @param[in] policy  New growth policy, or a null pointer to restore the default policy
+ *                    (grow by @ref STRB_GROW_FACTOR with no limit or rounding).
+ */
+void strb_setgrowth(_Optional const strbgrowth_t *policy);
+
+/**
+ * @brief Get the policy for growing internal buffers
+ *
+ * @param[out] policy  Object in which to store the current growth policy.
+ */
+void strb_getgrowth(strbgrowth_t *policy);
+#endif // !STRB_STATIC_ALLOC
+#endif // !STRB_FREESTANDING
 
 /**
  * @brief Get a pointer to the character array underlying a string buffer.
@@ -500,6 +821,9 @@ void strb_free(_Optional strb_t *sb);
  * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
  *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
  * @post The returned pointer is valid until the next call to a strb_... function.
+ * @post If the buffer was shared with a clone and a private copy could not be allocated,
+ *       the shared buffer's address is returned and a call to @ref strb_error will return
+ *       true until @ref strb_clearerr has been called. The string must not be modified.
  */
 char *strb_ptr(strb_t *sb);
 
@@ -530,6 +854,31 @@ const char *strb_cptr(strb_t const *sb);
  */
 size_t strb_len(strb_t const *sb);
 
+#if STRB_HASH
+/**
+ * @brief Get a hash of the string in a string buffer.
+ *
+ * Computes a fast, non-cryptographic 64-bit hash of the characters in a string buffer,
+ * including any null characters before the end. Strings with the same content have the
+ * same hash, within one program execution. The strings returned by @ref strb_intern
+ * have the same hash as other strings with the same content.
+ *
+ * The hash of all but the last few characters is cached, so calling this function again
+ * for an unmodified string takes constant time, and calling it after appending to a
+ * string only hashes the appended characters. The cache is discarded when characters
+ * are inserted, overwritten or deleted before the end of the hashed characters, and by
+ * @ref strb_ptr (because the caller can modify the string through the returned pointer).
+ * Nothing is cached for a string in an array supplied by @ref strb_use, @ref strb_reuse or
+ * @ref strb_reuse_const, which the caller can modify directly, so it is hashed every time.
+ *
+ * @param[in] sb  String buffer.
+ * @return Hash of the string.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ */
+uint64_t strb_hash(strb_t const *sb);
+#endif
+
 /**
  * @brief Editing mode.
  */
@@ -619,6 +968,203 @@ int strb_seek(strb_t *sb, size_t pos);
  */
 size_t strb_tell(strb_t const *sb);
 
+/**
+ * @brief Move the editing position of a string buffer to the next occurrence of some characters.
+ *
+ * Searches the string in a buffer for the first @p len characters at @p needle (which may
+ * include null characters), starting at the current editing position. Only characters
+ * before the end of the string (as reported by @ref strb_len) are searched. If the
+ * characters are found, the editing position is moved to the start of the first occurrence.
+ * An empty needle is found at the current position, if that is not beyond the end.
+ *
+ * Failure to find the characters is not an error, so the error indicator is not set.
+ *
+ * @param[in,out] sb      String buffer.
+ * @param[in]     needle  Characters to find.
+ * @param         len     Number of characters at @p needle.
+ * @return Zero if found, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post If successful, @ref strb_tell returns the position at which the characters were found,
+ *       and the effects on other functions are the same as for @ref strb_seek.
+ * @post On failure, the editing position is unchanged.
+ */
+int strb_find(strb_t *restrict sb, const char *restrict needle, size_t len);
+
+/**
+ * @brief Move the editing position of a string buffer to the next occurrence of a string.
+ *
+ * Equivalent to @c strb_find(sb, needle, strlen(needle)).
+ *
+ * @param[in,out] sb      String buffer.
+ * @param[in]     needle  String to find.
+ * @return Zero if found, otherwise EOF.
+ * @see strb_find
+ */
+int strb_seekstr(strb_t *restrict sb, const char *restrict needle);
+
+#if STRB_LINES
+/**
+ * @brief Move the editing position of a string buffer to the start of a line.
+ *
+ * Lines are separated by newline characters and numbered from zero. Only characters before
+ * the end of the string are considered, so there is always one more line than there are
+ * newline characters, and the last line may be empty.
+ *
+ * The start of each line is recorded in an index when first needed, which is extended as the
+ * string grows and truncated when characters before its end are changed. Subsequent calls only
+ * take constant time, unless the string has been changed. No index is attached to string buffer
+ * objects created by @ref strb_use, @ref strb_reuse or @ref strb_reuse_const (which need not be
+ * freed), so lines are found by scanning the string from the start every time.
+ *
+ * Failure to find the line is not an error, so the error indicator is not set.
+ *
+ * @param[in,out] sb    String buffer.
+ * @param         line  Number of the line.
+ * @return Zero if found, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post If successful, @ref strb_tell returns the position at which the line starts,
+ *       and the effects on other functions are the same as for @ref strb_seek.
+ * @post On failure, the editing position is unchanged. If the index could not be allocated,
+ *       a call to @ref strb_error will return true until @ref strb_clearerr has been called.
+ * @see strb_free
+ */
+int strb_seekline(strb_t *sb, size_t line);
+
+/**
+ * @brief Get the number of the line containing a position in a string buffer.
+ *
+ * Uses the same index of lines as @ref strb_seekline, to find the line in logarithmic time.
+ * If there is no index (as for const string buffer objects, including those returned by
+ * @ref strb_intern), then newline characters are counted every time. Positions beyond the
+ * end of the string are treated as being at the end.
+ *
+ * @param[in] sb   String buffer.
+ * @param     pos  Position, in characters.
+ * @return Number of newline characters before @p pos.
+ * @see strb_free
+ */
+size_t strb_lineof(strb_t const *sb, size_t pos);
+#endif
+
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+/**
+ * @brief Compiled set of patterns to be found by @ref strb_match_all
+ *
+ * An object type that need not be a complete type.
+ */
+typedef struct strbmatcher_t strbmatcher_t;
+
+/**
+ * @brief Function called by @ref strb_match_all for each occurrence of a pattern
+ *
+ * @param[in] arg      Argument passed to @ref strb_match_all.
+ * @param     pattern  Index of the pattern in the array passed to @ref strb_matcher_compile.
+ * @param     pos      Position of the first character of the occurrence.
+ * @return Zero to continue searching, otherwise a value to be returned by @ref strb_match_all.
+ */
+typedef int strbmatchfn_t(_Optional void *arg, size_t pattern, size_t pos);
+
+/**
+ * @brief Compile a set of patterns to be found together.
+ *
+ * Builds an automaton (as described by Aho and Corasick) that finds every occurrence of
+ * any of the given strings in a single pass over a string buffer. Empty patterns are
+ * allowed but never match. The same pattern may appear more than once.
+ *
+ * @param[in] patterns  Array of strings to find.
+ * @param     n         Number of strings in the array.
+ * @return Address of the compiled patterns, or a null pointer on failure.
+ * @post The user is responsible for calling @ref strb_matcher_free to free the compiled
+ *       patterns. The array of patterns is not used after this function returns.
+ */
+_Optional strbmatcher_t *strb_matcher_compile(const char *const patterns[], size_t n);
+
+/**
+ * @brief Destroy a set of compiled patterns.
+ *
+ * May be called with a null pointer, in which case this function has no effect.
+ *
+ * @param[in] m  Compiled patterns to destroy, or a null pointer.
+ */
+void strb_matcher_free(_Optional strbmatcher_t *m);
+
+/**
+ * @brief Find every occurrence of a set of patterns in a string buffer.
+ *
+ * Searches the whole string in a buffer (up to the length reported by @ref strb_len),
+ * regardless of the editing position, and calls @p callback for each occurrence of each
+ * pattern, including occurrences that overlap. Occurrences are reported in order of their
+ * last character; those that end at the same position are reported longest first.
+ * The string buffer isn't modified, so it may be a constant string.
+ *
+ * @param[in] sb        String buffer to search.
+ * @param[in] m         Patterns compiled by @ref strb_matcher_compile.
+ * @param[in] callback  Function to call for each occurrence.
+ * @param[in] arg       Argument to pass to @p callback.
+ * @return Zero if the search was completed, otherwise the value returned by @p callback
+ *         to stop the search.
+ */
+int strb_match_all(strb_t const *sb, const strbmatcher_t *m, strbmatchfn_t *callback,
+                   _Optional void *arg);
+#endif
+
+#if STRB_RESTORE
+/**
+ * @brief Tokenizer state
+ *
+ * State used by @ref strb_tok_next to split the string in a buffer into fields. It must be
+ * initialized by calling @ref strb_tok_init.
+ */
+typedef struct {
+    /** Start of the current field, or a null pointer if there is none */
+    _Optional const char *ptr;
+    /** Length of the current field, in characters */
+    size_t len;
+    /** @private */
+    bool terminate, split;
+} strb_tok_t;
+
+/**
+ * @brief Initialize the state of a tokenizer.
+ *
+ * @param[out] it         Tokenizer state.
+ * @param      terminate  Whether to terminate each field with a null character.
+ * @post There is no current field.
+ */
+void strb_tok_init(strb_tok_t *it, bool terminate);
+
+/**
+ * @brief Find the next field in a string buffer.
+ *
+ * Skips any delimiters at the current editing position, then finds the field of characters
+ * that follows them, as @c strtok does. The editing position is moved to the end of the field.
+ * Characters are not moved or copied: the field is stored in @p it as the address and length
+ * of characters in the buffer. Like @c strtok, consecutive delimiters are treated as one and
+ * no empty field is found.
+ *
+ * If the tokenizer was initialized to terminate fields, then the delimiter after the field
+ * (if any) is overwritten with a null character, as if by @ref strb_split. The delimiter is
+ * restored by the next call to this function, or by calling @ref strb_restore.
+ *
+ * A set of delimiters is passed to each call, so it can differ between fields.
+ *
+ * @param[in,out] sb      String buffer.
+ * @param[in,out] it      Tokenizer state.
+ * @param[in]     delims  String of delimiter characters.
+ * @return Zero if a field was found, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @pre  @p it was initialized by @ref strb_tok_init.
+ * @post The field is valid until the next call or until the string is otherwise modified.
+ * @post If no field was found, any delimiters were skipped. On failure to terminate
+ *       a field, a call to @ref strb_error will return true until @ref strb_clearerr
+ *       has been called.
+ */
+int strb_tok_next(strb_t *restrict sb, strb_tok_t *restrict it, const char *restrict delims);
+#endif
+
 /**
  * @brief Put a character into a string buffer.
  *
@@ -640,7 +1186,7 @@ size_t strb_tell(strb_t const *sb);
  * @post On failure, a call to @ref strb_error will return true until
  *       @ref strb_clearerr has been called.
  */
-int strb_putc(strb_t *sb, int c);
+inline int strb_putc(strb_t *sb, int c);
 
 /**
  * @brief Put a character into a string buffer multiple times.
@@ -712,7 +1258,7 @@ int strb_unputc(strb_t *sb);
  * @post On failure, a call to @ref strb_error will return true until
  *       @ref strb_clearerr has been called.
  */
-int strb_puts(strb_t *restrict sb, const char *restrict str);
+inline int strb_puts(strb_t *restrict sb, const char *restrict str);
 
 /**
  * @brief Put a sequence of characters into a string buffer.
@@ -738,7 +1284,66 @@ int strb_puts(strb_t *restrict sb, const char *restrict str);
  */
 int strb_nputs(strb_t *restrict sb, const char *restrict str, size_t n);
 
-#if !STRB_FREESTANDING
+/**
+ * @brief Put several strings into a string buffer.
+ *
+ * Copies the strings designated by the elements of @p strs, in order, into the buffer at the
+ * current position as if by calling @ref strb_puts for each string. Unlike such a sequence of
+ * calls, room is made for all of the characters at once, so that any following characters
+ * are moved only once. The terminating null characters are not copied.
+ *
+ * @param[in,out] sb     String buffer.
+ * @param[in]     strs   Array of strings to be copied into the buffer.
+ * @param         count  Number of elements in @p strs.
+ * @return Zero if successful, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post If successful, the position indicator has advanced by the number of characters copied
+ *       and the string length has increased by not more than the number of characters copied.
+ * @post If successful, the last character copied can be removed by @ref strb_unputc.
+ * @post If successful, a call to @ref strb_restore will have no effect until
+ *       @ref strb_write has been called.
+ * @post On failure, no characters have been copied and a call to @ref strb_error will return
+ *       true until @ref strb_clearerr has been called.
+ */
+int strb_putsv(strb_t *restrict sb, const char *const strs[], size_t count);
+
+/**
+ * @brief A sequence of characters to be copied by @ref strb_nputsv.
+ */
+typedef struct {
+    /** Address of the first character */
+    const char *ptr;
+    /** Maximum number of characters to copy from @p ptr */
+    size_t len;
+} strbspan_t;
+
+/**
+ * @brief Put several sequences of characters into a string buffer.
+ *
+ * Copies the sequences of characters designated by the elements of @p spans, in order, into
+ * the buffer at the current position as if by calling @ref strb_nputs for each sequence.
+ * Unlike such a sequence of calls, room is made for all of the characters at once, so that
+ * any following characters are moved only once. A null character and any characters following
+ * it in the same sequence are not copied.
+ *
+ * @param[in,out] sb     String buffer.
+ * @param[in]     spans  Array of sequences to be copied into the buffer.
+ * @param         count  Number of elements in @p spans.
+ * @return Zero if successful, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post If successful, the position indicator has advanced by the number of characters copied
+ *       and the string length has increased by not more than the number of characters copied.
+ * @post If successful, the last character copied can be removed by @ref strb_unputc.
+ * @post If successful, a call to @ref strb_restore will have no effect until
+ *       @ref strb_write has been called.
+ * @post On failure, no characters have been copied and a call to @ref strb_error will return
+ *       true until @ref strb_clearerr has been called.
+ */
+int strb_nputsv(strb_t *restrict sb, const strbspan_t spans[], size_t count);
+
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
 /**
  * @brief Put a generated string into a string buffer.
  *
@@ -757,8 +1362,9 @@ int strb_nputs(strb_t *restrict sb, const char *restrict str, size_t n);
  * @post If successful, the last character written can be removed by @ref strb_unputc.
  * @post If successful, a call to @ref strb_restore will have no effect until
  *       @ref strb_write has been called.
- * @post On failure, a call to @ref strb_error will return true until
- *       @ref strb_clearerr has been called.
+ * @post On failure, the string is unchanged unless the mode is @ref strb_overwrite, in which
+ *       case characters after the position may have been overwritten. A call to
+ *       @ref strb_error will return true until @ref strb_clearerr has been called.
  */
 int strb_vputf(strb_t *restrict sb, const char *restrict format, va_list args);
 
@@ -780,8 +1386,9 @@ int strb_vputf(strb_t *restrict sb, const char *restrict format, va_list args);
  * @post If successful, the last character written can be removed by @ref strb_unputc.
  * @post If successful, a call to @ref strb_restore will have no effect until
  *       @ref strb_write has been called.
- * @post On failure, a call to @ref strb_error will return true until
- *       @ref strb_clearerr has been called.
+ * @post On failure, the string is unchanged unless the mode is @ref strb_overwrite, in which
+ *       case characters after the position may have been overwritten. A call to
+ *       @ref strb_error will return true until @ref strb_clearerr has been called.
  */
 int strb_putf(strb_t *restrict sb, const char *restrict format, ...);
 #endif
@@ -895,6 +1502,33 @@ void strb_restore(strb_t *sb);
  */
 void strb_delto(strb_t *sb, size_t pos);
 
+/**
+ * @brief Replace every occurrence of a string in a string buffer with another string.
+ *
+ * Searches the whole string in a buffer for occurrences of @p from, regardless of the current
+ * editing position, and replaces each of them with @p to. Occurrences do not overlap: searching
+ * resumes after each one found. The replacements are made in one pass, regardless of the mode,
+ * and at most one bigger buffer is substituted. An empty @p from does not occur anywhere.
+ *
+ * The position indicator keeps its place in the text: it moves by the difference in length
+ * between @p to and @p from for each occurrence that ends at or before it. If it was inside
+ * an occurrence then it moves to the start of that occurrence's replacement.
+ *
+ * @param[in,out] sb    String buffer.
+ * @param[in]     from  String to replace.
+ * @param[in]     to    Replacement string.
+ * @return Number of occurrences replaced, which is zero on failure.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post The mode is unchanged. The position indicator is unchanged unless something was
+ *       replaced before it.
+ * @post A call to @ref strb_unputc or @ref strb_restore will have no effect until
+ *       @ref strb_putc or @ref strb_write has been called, unless nothing was replaced.
+ * @post On failure, the string is unchanged and a call to @ref strb_error will return
+ *       true until @ref strb_clearerr has been called.
+ */
+size_t strb_replace_all(strb_t *restrict sb, const char *restrict from, const char *restrict to);
+
 /**
  * @brief Copy a string into a string buffer.
  *
@@ -936,7 +1570,7 @@ int strb_cpy(strb_t *restrict sb, const char *restrict str);
  */
 int strb_ncpy(strb_t *restrict sb, const char *restrict str, size_t n);
 
-#if !STRB_FREESTANDING
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
 
 /**
  * @brief Print a generated string into a string buffer.
@@ -983,6 +1617,274 @@ int strb_vprintf(strb_t *restrict sb, const char *restrict format, va_list args)
 int strb_printf(strb_t *restrict sb, const char *restrict format, ...);
 #endif
 
+/**
+ * @brief Reserve storage in a string buffer.
+ *
+ * Ensures that the string in a buffer can grow to a length of @p n characters without
+ * any further storage allocation. Callers who know the final size of a string can use
+ * this to avoid repeatedly substituting bigger buffers. Any buffer substituted by this
+ * function is only as big as needed for @p n characters and a terminating null character,
+ * subject to the allocation granularity of the platform.
+ *
+ * @param[in,out] sb  String buffer.
+ * @param         n   Required capacity, in characters, excluding the terminating null character.
+ * @return Zero if successful, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post The string, its length, the position indicator and the mode are unchanged.
+ * @post On failure, a call to @ref strb_error will return true until
+ *       @ref strb_clearerr has been called.
+ */
+int strb_reserve(strb_t *sb, size_t n);
+
+/**
+ * @brief Release unused storage in a string buffer.
+ *
+ * Substitutes a buffer that is just big enough for the current string (or position, if greater)
+ * if the existing buffer was allocated separately from the string buffer object. This is useful
+ * for long-lived strings that will not grow again. This function has no effect on character arrays
+ * passed to @ref strb_use or @ref strb_reuse, or internal buffers of fixed size. It cannot fail.
+ *
+ * @param[in,out] sb  String buffer.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post The string, its length, the position indicator and the mode are unchanged.
+ */
+void strb_shrink_to_fit(strb_t *sb);
+
+#if !STRB_FREESTANDING
+/**
+ * @brief Write the contents of a string buffer to a stream.
+ *
+ * Writes the string in a buffer, excluding the terminating null character, to @p stream
+ * as if by calling @c fwrite. The string is written from where it is stored, without first
+ * being copied or made contiguous.
+ *
+ * @param[in]     sb      String buffer.
+ * @param[in,out] stream  Stream to which to write the string.
+ * @return Zero if successful, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post The string buffer is unchanged.
+ * @post On failure, the error indicator of @p stream is set and an unspecified number of
+ *       characters may have been written.
+ */
+int strb_fwrite(strb_t const *sb, FILE *stream);
+#endif
+
+#if STRB_FOPEN
+/**
+ * @brief Open a stream that reads and writes a string buffer.
+ *
+ * Creates a stream through which standard I/O functions such as @c fprintf, @c fputs and
+ * @c fwrite put characters into the buffer at the current position, as if by calling
+ * @ref strb_nputs, and @c fread and @c fgetc get characters from it. The mode of the
+ * string buffer (insert or overwrite) is honoured. Seeking the stream seeks the string buffer.
+ *
+ * The stream is fully buffered by default, like a file, so characters are put into the string
+ * buffer in large blocks. Call @c fflush or @c fclose before using the string buffer directly,
+ * and @c fflush or @c fseek after using it directly, or else call @c setvbuf to make the stream
+ * unbuffered so that each call to a standard I/O function updates the string buffer immediately.
+ *
+ * @param[in,out] sb    String buffer.
+ * @param[in]     mode  Mode string as for @c fopen. It only determines which operations are
+ *                      permitted: opening for writing does not truncate the string and opening
+ *                      for appending does not move the position indicator.
+ * @return The new stream, or a null pointer on failure.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post The string buffer must not be destroyed until the stream has been closed.
+ * @post If characters cannot be stored, the error indicators of both the stream and
+ *       the string buffer are set.
+ */
+_Optional FILE *strb_fopen(strb_t *sb, const char *mode);
+#endif
+
+#if STRB_POSIX
+/**
+ * @brief Write the contents of a string buffer to a file descriptor.
+ *
+ * Writes the string in a buffer, excluding the terminating null character, to the file
+ * associated with @p fd. Writing is retried if interrupted by a signal or if fewer characters
+ * than requested were written, until the whole string has been written or an error occurs.
+ *
+ * @param[in] sb  String buffer.
+ * @param     fd  File descriptor open for writing.
+ * @return Zero if successful, otherwise EOF (with @c errno set by @c write or @c writev).
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post The string buffer is unchanged.
+ * @post On failure, an unspecified number of characters may have been written.
+ */
+int strb_write_fd(strb_t const *sb, int fd);
+
+/**
+ * @brief Write the contents of several string buffers to a file descriptor.
+ *
+ * Writes the strings in an array of buffers, in order and excluding their terminating null
+ * characters, to the file associated with @p fd. The strings are gathered by as few calls to
+ * @c writev as possible, without being copied. Writing is retried as for @ref strb_write_fd.
+ *
+ * @param     fd   File descriptor open for writing.
+ * @param[in] sbs  Array of string buffers.
+ * @param     n    Number of elements in @p sbs.
+ * @return Zero if successful, otherwise EOF (with @c errno set by @c writev).
+ * @pre  Every element of @p sbs was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post The string buffers are unchanged.
+ * @post On failure, an unspecified number of characters may have been written.
+ */
+int strb_writev_fd(int fd, strb_t *const sbs[], size_t n);
+#endif
+
+#if !STRB_FREESTANDING
+/**
+ * @brief Read characters from a stream into a string buffer.
+ *
+ * Reads up to @p max characters from @p stream, stopping early only at end-of-file or on error,
+ * and puts them into the buffer at the current position as if by calling @ref strb_putc for each
+ * character. When the position is at the end of the string, characters are read directly into
+ * free space in the buffer, which is enlarged as necessary. Null characters are stored like any
+ * other character.
+ *
+ * @param[in,out] sb      String buffer.
+ * @param[in,out] stream  Stream from which to read characters.
+ * @param         max     Maximum number of characters to read, or SIZE_MAX for no limit.
+ * @return Zero if successful, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post Any characters read before a failure remain in the buffer, as if they had been put
+ *       into it by separate calls.
+ * @post On failure to read from @p stream, the error indicator of @p stream is set.
+ * @post On failure to store a character that was read, a call to @ref strb_error will return
+ *       true until @ref strb_clearerr has been called.
+ */
+int strb_fread(strb_t *sb, FILE *stream, size_t max);
+
+#if STRB_POSIX
+/**
+ * @brief Read characters from a file descriptor into a string buffer.
+ *
+ * Reads up to @p max characters from the file associated with @p fd, stopping early only at
+ * end-of-file or on error, and puts them into the buffer as described for @ref strb_fread.
+ * Reading is retried if interrupted by a signal.
+ *
+ * @param[in,out] sb   String buffer.
+ * @param         fd   File descriptor open for reading.
+ * @param         max  Maximum number of characters to read, or SIZE_MAX for no limit.
+ * @return Zero if successful, otherwise EOF (with @c errno set by @c read if reading failed).
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post Any characters read before a failure remain in the buffer, as if they had been put
+ *       into it by separate calls.
+ * @post On failure to store a character that was read, a call to @ref strb_error will return
+ *       true until @ref strb_clearerr has been called.
+ */
+int strb_read_fd(strb_t *sb, int fd, size_t max);
+#endif
+
+/**
+ * @brief Read a whole file into a string buffer.
+ *
+ * Opens the file named by @p path and puts its contents into the buffer as described for
+ * @ref strb_fread. Where file sizes are known in advance, room is made for the whole file
+ * before reading, so that the buffer is enlarged at most once.
+ *
+ * @param[in,out] sb    String buffer.
+ * @param[in]     path  Name of the file to be read.
+ * @return Zero if successful, otherwise EOF.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ * @post If the file could not be opened, the string buffer is unchanged.
+ * @post If the file is known to be too big for the buffer, no characters have been read.
+ * @post Any characters read before any other failure remain in the buffer.
+ * @post On failure to store the characters, a call to @ref strb_error will return
+ *       true until @ref strb_clearerr has been called.
+ */
+int strb_readfile(strb_t *sb, const char *path);
+#endif
+
+#if !STRB_FREESTANDING && STRB_EXT_STATE
+/**
+ * @brief String interning table
+ *
+ * An object type that maps the content of strings to unique immutable string buffer
+ * objects. It need not be a complete type.
+ */
+typedef struct strbintern_t strbintern_t;
+
+/**
+ * @brief Create an empty string interning table.
+ *
+ * If STRB_STATIC_ALLOC is defined then the table is allocated from a fixed pool of
+ * @ref STRB_INTERN_TABLES tables, each of which can hold up to @ref STRB_INTERN_MAX
+ * strings in @ref STRB_INTERN_ARENA_SIZE bytes. Otherwise, the table grows as needed.
+ *
+ * @return Address of the created table, or a null pointer on failure.
+ * @post The user is responsible for calling @ref strb_intern_free to free the table.
+ */
+_Optional strbintern_t *strb_intern_alloc(void);
+
+/**
+ * @brief Destroy a string interning table and all of the strings in it.
+ *
+ * May be called with a null pointer, in which case this function has no effect.
+ *
+ * @param[in] table  Table to destroy, or a null pointer.
+ * @post @p table and any string buffer object returned by @ref strb_intern for it are
+ *       invalid for use with any function.
+ */
+void strb_intern_free(_Optional strbintern_t *table);
+
+/**
+ * @brief Get the unique string buffer object for a string.
+ *
+ * Looks up the first @p len characters at @p str (which may include null characters) in
+ * a table. If no string with the same content has been interned, a copy of the characters
+ * is added to the table. Every call with the same content returns the same address, so
+ * interned strings can be compared for equality by comparing their addresses.
+ *
+ * Strings are stored contiguously with their state and never move or change until the
+ * table is destroyed. The returned object cannot be modified; @ref strb_cptr, @ref strb_len
+ * and other functions that do not modify a string buffer can be used with it. Calling
+ * @ref strb_free for it has no effect.
+ *
+ * @param[in,out] table  Table in which to find or add the string.
+ * @param[in]     str    Characters to find or add.
+ * @param         len    Number of characters at @p str.
+ *
+ * @return Address of the unique string buffer object with the given content, or a null
+ *         pointer if the string is too long or the table is full and can't be enlarged.
+ * @post The returned object is valid until @ref strb_intern_free is called for @p table.
+ */
+_Optional const strb_t *strb_intern(strbintern_t *restrict table, const char *restrict str,
+                                    size_t len);
+#endif
+
+#if STRB_STATS
+/**
+ * @brief Get statistics about operations on a string buffer.
+ *
+ * Gets the counters accumulated by a string buffer object since it was created.
+ *
+ * @param[in]  sb   String buffer.
+ * @param[out] out  Object in which to store the statistics.
+ * @pre  The given @p sb address was returned by @ref strb_use, @ref strb_reuse,
+ *       @ref strb_alloc, @ref strb_dup, @ref strb_ndup, @ref strb_aprintf or @ref strb_vaprintf.
+ */
+void strb_getstats(strb_t const *sb, strbstats_t *out);
+
+/**
+ * @brief Get statistics about operations on all string buffers.
+ *
+ * Gets the counters accumulated by all string buffer objects since the program started,
+ * including objects that have since been destroyed. These totals are not thread-safe.
+ *
+ * @param[out] out  Object in which to store the statistics.
+ */
+void strb_gettotalstats(strbstats_t *out);
+#endif
+
 /**
  * @brief Get the error indicator of a string buffer.
  *
@@ -1015,3 +1917,47 @@ bool strb_error(strb_t const *sb);
  * @post A call to @ref strb_error will return false until an error occurs.
  */
 void strb_clearerr(strb_t *sb);
+
+// Appending in insert mode with spare capacity is the common case, so it is handled
+// inline. Everything else is done by strb_nputc or strb_private_put.
+
+// Not part of the API: equivalent to strb_nputs for a string already known to be
+// exactly len characters long, so that it needn't be measured again.
+int strb_private_put(strb_t *restrict sb, const char *restrict str, size_t len);
+
+inline int strb_putc(strb_t *sb, int c)
+{
+    strbprivate_t *const p = (strbprivate_t *)sb;
+
+    if (STRB_PRIVATE_CAN_APPEND(p) && p->size - p->len > 1) {
+        p->buf[p->len++] = (char)c;
+        p->buf[p->len] = '\0';
+        p->pos = p->len;
+#if STRB_RESTORE
+        p->restore_char = '\0';
+#endif
+        p->flags |= STRB_PRIVATE_CAN_UNPUTC | STRB_PRIVATE_CAN_RESTORE;
+        return c;
+    }
+    return strb_nputc(sb, c, 1);
+}
+
+inline int strb_puts(strb_t *restrict sb, const char *restrict str)
+{
+    strbprivate_t *const p = (strbprivate_t *)sb;
+    const size_t n = strlen(str);
+
+    if (STRB_PRIVATE_CAN_APPEND(p) && n < (size_t)(p->size - p->len)) {
+        memcpy(p->buf + p->len, str, n + 1);
+        p->len += n;
+        p->pos = p->len;
+#if STRB_RESTORE
+        p->restore_char = '\0';
+#endif
+        p->flags |= STRB_PRIVATE_CAN_RESTORE;
+        if (n)
+            p->flags |= STRB_PRIVATE_CAN_UNPUTC;
+        return 0;
+    }
+    return strb_private_put(sb, str, n);
+}
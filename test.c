@@ -1,18 +1,27 @@
 // Copyright 2024 Christopher Bazley
 // SPDX-License-Identifier: MIT
 
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include "strb.h"
 
+#if STRB_POSIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 static void test(strb_t *s)
 {
     int i;
-    char *found;
     size_t pos;
     
     if (!s) return;
@@ -21,7 +30,7 @@ static void test(strb_t *s)
         assert(!strb_seek(s, 0));
         assert(strb_putc(s, 'a' + i) == 'a' + i);
         assert(strb_ptr(s)[strb_len(s)] == '\0');
-#if !STRB_FREESTANDING
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
         assert(!strb_putf(s, "fmt%dx", i));
         assert(strb_ptr(s)[strb_len(s)] == '\0');
 #if STRB_UNPUTC
@@ -31,7 +40,7 @@ static void test(strb_t *s)
 #if STRB_UNPUTC
         assert(strb_unputc(s) == 'a' + i);
 #endif
-#endif // !STRB_FREESTANDING
+#endif // !STRB_FREESTANDING || STRB_NATIVE_FMT
         assert(strb_ptr(s)[strb_len(s)] == '\0');
 #if STRB_UNPUTC
         assert(strb_unputc(s) == EOF);
@@ -58,9 +67,9 @@ static void test(strb_t *s)
     assert(!strb_setmode(s, strb_insert));
     assert(strb_getmode(s) == strb_insert);
 
-    found = strstr(strb_ptr(s), "fmt4");
-    if (found) {
-        assert(!strb_seek(s, (size_t)(found - strb_ptr(s))));
+    assert(!strb_seek(s, 0));
+    if (!strb_seekstr(s, "fmt4")) {
+        assert(!strncmp(strb_cptr(s) + strb_tell(s), "fmt4", 4));
         printf("%zu\n", strb_tell(s));
         assert(!strb_puts(s, "INSERT"));
         assert(strb_ptr(s)[strb_len(s)] == '\0');
@@ -155,6 +164,30 @@ static void test(strb_t *s)
     assert(!strcmp(strb_ptr(s), "FEEL"));
     assert(strb_len(s) == strlen("FEEL"));
 
+    {
+        static const char *const strs[] = {"-", "", "ab", "c"};
+        static const strbspan_t spans[] = {{"xyz", 2}, {"q\0r", 3}, {"", SIZE_MAX}};
+
+        assert(!strb_putsv(s, strs, sizeof strs / sizeof strs[0])); // make "FEE-abcL"
+        assert(strb_tell(s) == strlen("FEE-abc"));
+        assert(strb_ptr(s)[strb_len(s)] == '\0');
+        puts(strb_ptr(s));
+        assert(!strcmp(strb_ptr(s), "FEE-abcL"));
+
+        assert(!strb_nputsv(s, spans, sizeof spans / sizeof spans[0])); // make "FEE-abcxyqL"
+        assert(!strb_putsv(s, strs, 0));
+        assert(strb_tell(s) == strlen("FEE-abcxyq"));
+        puts(strb_ptr(s));
+        assert(!strcmp(strb_ptr(s), "FEE-abcxyqL"));
+#if STRB_UNPUTC
+        assert(strb_unputc(s) == 'q');
+        assert(!strcmp(strb_ptr(s), "FEE-abcxyL"));
+#endif
+        assert(!strb_seek(s, strlen("FEE")));
+        strb_delto(s, strb_len(s) - 1); // make "FEEL" again
+        assert(!strcmp(strb_ptr(s), "FEEL"));
+    }
+
     assert(!strb_cpy(s, "No"));
     assert(strb_ptr(s)[strb_len(s)] == '\0');
     assert(!strcmp(strb_ptr(s), "No"));
@@ -173,7 +206,7 @@ static void test(strb_t *s)
     assert(strb_len(s) == 3);
     puts(strb_ptr(s));
 
-#if !STRB_FREESTANDING
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
     assert(!strb_printf(s, "R%dD%d", 2, 2));
     assert(strb_ptr(s)[strb_len(s)] == '\0');
     assert(!strcmp(strb_ptr(s), "R2D2"));
@@ -245,7 +278,7 @@ static void test(strb_t *s)
     assert(strb_ptr(s)[strb_len(s)] == '\0');
 #endif
 
-#endif // !STRB_FREESTANDING
+#endif // !STRB_FREESTANDING || STRB_NATIVE_FMT
 
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
     {
@@ -282,6 +315,173 @@ static void test(strb_t *s)
     puts("========");
 }
 
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
+#define CHECK_FMT(...) \
+    do { \
+        snprintf(expect, sizeof expect, __VA_ARGS__); \
+        assert(!strb_printf(s, __VA_ARGS__)); \
+        assert(!strcmp(strb_cptr(s), expect)); \
+        assert(strb_len(s) == strlen(expect)); \
+        puts(strb_cptr(s)); \
+    } while (0)
+
+static void test_fmt(strb_t *s)
+{
+    char expect[256];
+    int n = 0;
+
+    if (!s) return;
+
+    CHECK_FMT("%d|%i|%5d|%-5d|%05d|%+d|% d|%.3d|%.0d|", 42, -42, 42, 42, -42, 42, 42, 7, 0);
+    CHECK_FMT("%u|%o|%#o|%x|%#x|%X|%#X|%#.0o|%#x|", 0u, 8u, 8u, 255u, 255u, 255u, 255u, 0u, 0u);
+    CHECK_FMT("%hhd|%hd|%ld|%lld|%jd|%zd|%td|", 300, 70000, -5L, LLONG_MIN, INTMAX_MAX,
+              (ptrdiff_t)-3, (ptrdiff_t)-4);
+    CHECK_FMT("%hhu|%hu|%lu|%llu|%ju|%zu|", 300, 70000, ULONG_MAX, ULLONG_MAX, UINTMAX_MAX, SIZE_MAX);
+    CHECK_FMT("%c%5c%-3c|%%|", 'a', 'b', 'c');
+    CHECK_FMT("%s|%10s|%-10s|%.2s|%*s|%-*.*s|", "str", "str", "str", "str", 6, "str", 6, 2, "str");
+    CHECK_FMT("%*d|%*d|%.*d|%0*d|", -4, 1, 4, 2, -1, 3, 5, -6);
+
+    assert(!strb_printf(s, "abc%nd", &n));
+    assert(n == 3);
+    assert(!strcmp(strb_cptr(s), "abcd"));
+
+#if !STRB_FREESTANDING
+    CHECK_FMT("%f|%.2e|%g|%10.3f|%-8.1f|%La|%p|", 3.14159, 12345.678, 0.0001, -2.5, 1.0, 1.0L, (void *)expect);
+    CHECK_FMT("%.150f", 1.0); // too long for a scratch array
+    CHECK_FMT("%p|%20p|%-*p|%.3f|", (void *)expect, (void *)expect, 20, (void *)expect, 0.5);
+#endif
+
+#if STRB_NATIVE_FMT
+    assert(!strb_cpy(s, "keep"));
+    assert(!strb_seek(s, 2));
+    assert(strb_putf(s, "%d%", 1) == EOF); // incomplete conversion specification
+    assert(strb_error(s));
+    assert(!strcmp(strb_cptr(s), "keep"));
+    assert(strb_tell(s) == 2);
+    strb_clearerr(s);
+
+    assert(!strb_seek(s, strb_len(s)));
+    assert(strb_putf(s, "%s%", "x") == EOF);
+    assert(strb_error(s));
+    assert(!strcmp(strb_cptr(s), "keep"));
+    assert(strb_tell(s) == strlen("keep"));
+    strb_clearerr(s);
+#if STRB_FREESTANDING
+    assert(strb_putf(s, "%f", 1.0) == EOF);
+    assert(!strcmp(strb_cptr(s), "keep"));
+    strb_clearerr(s);
+#endif
+#endif // STRB_NATIVE_FMT
+
+    puts("========");
+}
+#endif // !STRB_FREESTANDING || STRB_NATIVE_FMT
+
+// Find characters by comparing them at every position, for reference
+static size_t naive_find(const char *hay, size_t hay_len, const char *needle, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + len <= hay_len; ++i) {
+        if (!memcmp(hay + i, needle, len))
+            return i;
+    }
+    return SIZE_MAX;
+}
+
+#if STRB_LINES
+// Count the occurrences of a character, for reference
+static size_t count_chars(const char *str, size_t len, char c)
+{
+    size_t i, count = 0;
+
+    for (i = 0; i < len; ++i)
+        count += str[i] == c;
+    return count;
+}
+#endif
+
+// Replace every occurrence of a string, for reference, also moving a position with the text
+static size_t naive_replace(char *out, const char *in, size_t len, const char *from,
+                            const char *to, size_t *count, size_t *pos)
+{
+    const size_t from_len = strlen(from), to_len = strlen(to), old_pos = *pos;
+    size_t i = 0, n = 0, at;
+
+    *count = 0;
+    while ((at = naive_find(in + i, len - i, from, from_len)) != SIZE_MAX) {
+        ++*count;
+        if (old_pos >= i && old_pos < i + at)
+            *pos = n + old_pos - i;
+        else if (old_pos >= i + at && old_pos < i + at + from_len)
+            *pos = n + at;
+        memcpy(out + n, in + i, at);
+        n += at;
+        memcpy(out + n, to, to_len);
+        n += to_len;
+        i += at + from_len;
+    }
+    if (old_pos >= i)
+        *pos = n + old_pos - i;
+    memcpy(out + n, in + i, len - i);
+    return n + len - i;
+}
+
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+typedef struct {
+    size_t n, stop_after;
+    size_t pattern[16], pos[16];
+} matches_t;
+
+// Record an occurrence of a pattern, stopping the search after a given number
+static int record_match(_Optional void *arg, size_t pattern, size_t pos)
+{
+    matches_t *const m = arg;
+
+    assert(m);
+    assert(m->n < sizeof m->pattern / sizeof m->pattern[0]);
+    m->pattern[m->n] = pattern;
+    m->pos[m->n] = pos;
+    return ++m->n == m->stop_after ? 42 : 0;
+}
+
+typedef struct {
+    const char *str;
+    const char *const *patterns;
+    size_t n;
+} check_t;
+
+// Check and count an occurrence of a pattern
+static int check_match(_Optional void *arg, size_t pattern, size_t pos)
+{
+    check_t *const c = arg;
+
+    assert(c);
+    assert(!memcmp(c->str + pos, c->patterns[pattern], strlen(c->patterns[pattern])));
+    ++c->n;
+    return 0;
+}
+#endif
+
+#if STRB_HASH && STRB_EXT_STATE
+// Hash a copy of some characters, in a string buffer with no cached hash
+static uint64_t fresh_hash(const char *str, size_t len)
+{
+    strbstate_t state;
+    char array[256];
+    strb_t *const s = strb_use(&state, sizeof array, array);
+    _Optional char *p;
+
+    assert(len < STRB_MAX_SIZE - 1);
+    p = strb_write(s, len);
+    assert(p);
+    memcpy(p, str, len);
+    return strb_hash(s);
+}
+
+#define CHECK_HASH(s) assert(strb_hash(s) == fresh_hash(strb_cptr(s), strb_len(s)))
+#endif
+
 int main(void)
 {
     char array[1000];
@@ -307,6 +507,9 @@ int main(void)
 #endif
 
     test(s);
+#if !STRB_FREESTANDING || STRB_NATIVE_FMT
+    test_fmt(s);
+#endif
 
     memset(array, 'a', sizeof array);
     assert(strb_reuse(&state, sizeof array, array) == NULL); // no null terminator
@@ -319,6 +522,553 @@ int main(void)
     puts(strb_ptr(s));
 #endif
 
+    {
+        // Finding characters from the current position
+        static const size_t lens[] = {1, 2, 3, 7, 8, 9, 16, 31, 32, 33, 40, 64};
+        char hay[200], needle[64];
+        unsigned int seed = 1;
+        size_t i, n, from;
+
+        s = strb_use(&state, sizeof array, array);
+        assert(!strb_puts(s, "one two one two three"));
+        assert(!strb_seek(s, 0));
+        assert(!strb_seekstr(s, "two"));
+        assert(strb_tell(s) == 4);
+        assert(!strb_seekstr(s, "two")); // already there
+        assert(strb_tell(s) == 4);
+        assert(!strb_seek(s, 5));
+        assert(!strb_seekstr(s, "two"));
+        assert(strb_tell(s) == 12);
+        assert(strb_seekstr(s, "one") == EOF); // only before the position
+        assert(strb_tell(s) == 12);
+        assert(!strb_error(s));
+        assert(!strb_seekstr(s, ""));
+        assert(strb_tell(s) == 12);
+        assert(!strb_find(s, "threesome", 5));
+        assert(strb_tell(s) == 16);
+        assert(strb_find(s, "threesome", 6) == EOF); // not beyond the end
+        assert(!strb_seek(s, strb_len(s)));
+        assert(!strb_seekstr(s, ""));
+        assert(!strb_seek(s, strb_len(s) + 1));
+        assert(strb_seekstr(s, "") == EOF);
+        assert(!strb_error(s));
+
+        assert(!strb_seek(s, strb_len(s) + 2));
+        assert(!strb_puts(s, "end")); // zero-filled first
+        assert(!strb_seek(s, 0));
+        assert(!strb_find(s, "\0\0e", 3));
+        assert(strb_tell(s) == strlen("one two one two three"));
+
+        // Compare with a naive search, using a small alphabet for many partial matches
+        for (i = 0; i < sizeof hay; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            hay[i] = "ab\0c"[(seed >> 16) % (i % 50 < 25 ? 2 : 4)];
+        }
+        s = strb_use(&state, sizeof array, array);
+        assert(strb_write(s, sizeof hay));
+        memcpy(strb_ptr(s), hay, sizeof hay);
+
+        for (n = 0; n < sizeof lens / sizeof lens[0]; ++n) {
+            for (from = 0; from + lens[n] <= sizeof hay; from += 7) {
+                // Take the needle from the haystack, sometimes changing its last character
+                memcpy(needle, hay + from, lens[n]);
+                if (from % 3 == 0)
+                    needle[lens[n] - 1] ^= 1;
+
+                for (i = 0; i < sizeof hay; i += 13) {
+                    const size_t expect = naive_find(hay + i, sizeof hay - i, needle, lens[n]);
+
+                    assert(!strb_seek(s, i));
+                    if (expect == SIZE_MAX) {
+                        assert(strb_find(s, needle, lens[n]) == EOF);
+                        assert(strb_tell(s) == i);
+                    } else {
+                        assert(!strb_find(s, needle, lens[n]));
+                        assert(strb_tell(s) == i + expect);
+                    }
+                }
+            }
+        }
+
+        // Periodic needles, which the Two-Way algorithm handles differently
+        memset(hay, 'a', sizeof hay);
+        memset(needle, 'a', sizeof needle);
+        needle[40] = 'b';
+        hay[150] = 'b';
+        s = strb_use(&state, sizeof array, array);
+        assert(strb_write(s, sizeof hay));
+        memcpy(strb_ptr(s), hay, sizeof hay);
+        assert(!strb_seek(s, 0));
+        assert(!strb_find(s, needle, 41));
+        assert(strb_tell(s) == 110);
+        assert(!strb_seek(s, 0));
+        assert(!strb_find(s, needle, 40));
+        assert(!strb_tell(s));
+        needle[39] = 'b';
+        assert(strb_find(s, needle, 41) == EOF);
+        needle[39] = needle[40] = 'a';
+        needle[20] = 'b'; // a candidate at every position, until Two-Way takes over
+        assert(!strb_seek(s, 0));
+        assert(!strb_find(s, needle, 41));
+        assert(strb_tell(s) == 130);
+        for (i = 0; i < 64; ++i)
+            needle[i] = "abaab"[i % 5];
+        for (i = 0; i < sizeof hay; ++i)
+            hay[i] = "abaab"[i % 5];
+        hay[120] = 'b';
+        s = strb_use(&state, sizeof array, array);
+        assert(strb_write(s, sizeof hay));
+        memcpy(strb_ptr(s), hay, sizeof hay);
+        for (i = 0; i < sizeof hay; i += 3) {
+            const size_t expect = naive_find(hay + i, sizeof hay - i, needle, 64);
+
+            assert(!strb_seek(s, i));
+            if (expect == SIZE_MAX) {
+                assert(strb_find(s, needle, 64) == EOF);
+            } else {
+                assert(!strb_find(s, needle, 64));
+                assert(strb_tell(s) == i + expect);
+            }
+        }
+    }
+
+    {
+        // Replacing every occurrence of a string, wherever the position is
+        static const char *const froms[] = {"a", "b", "ab", "aba", "bab"},
+                          *const tos[] = {"", "x", "ab", "bab", "xyzw"};
+        char hay[60], expect[256], small[16];
+        unsigned int seed = 1;
+        size_t i, f, t, count;
+
+        s = strb_use(&state, sizeof array, array);
+        assert(!strb_puts(s, "one two one two three"));
+        assert(!strb_seek(s, 4));
+        assert(strb_replace_all(s, "two", "2") == 2);
+        assert(!strcmp(strb_cptr(s), "one 2 one 2 three"));
+        assert(strb_tell(s) == 4); // at the start of a replacement
+        assert(strb_replace_all(s, "one", "three") == 2); // also before the position
+        assert(!strcmp(strb_cptr(s), "three 2 three 2 three"));
+        assert(strb_tell(s) == 6);
+        assert(!strb_seek(s, 3)); // inside an occurrence
+        assert(strb_replace_all(s, "three", "xyz") == 3);
+        assert(!strcmp(strb_cptr(s), "xyz 2 xyz 2 xyz"));
+        assert(!strb_tell(s));
+        assert(strb_replace_all(s, "four", "4") == 0);
+        assert(strb_replace_all(s, "", "4") == 0);
+        assert(!strb_tell(s));
+        assert(!strb_seek(s, strb_len(s) + 1)); // beyond the end
+        assert(strb_replace_all(s, "xyz", "1") == 3);
+        assert(!strcmp(strb_cptr(s), "1 2 1 2 1"));
+        assert(strb_tell(s) == 10);
+        assert(!strb_error(s));
+#if STRB_HASH
+        CHECK_HASH(s);
+#endif
+
+        // No room for longer strings in a small external array
+        s = strb_use(&state, sizeof small, small);
+        assert(!strb_puts(s, "aaaaaaaa"));
+        assert(!strb_seek(s, 0));
+        assert(strb_replace_all(s, "a", "bb") == 0);
+        assert(strb_error(s));
+        assert(!strcmp(strb_cptr(s), "aaaaaaaa"));
+        strb_clearerr(s);
+        assert(strb_replace_all(s, "aa", "bbb") == 4);
+        assert(!strcmp(strb_cptr(s), "bbbbbbbbbbbb"));
+        assert(strb_len(s) == 12);
+
+        // Compare with a naive replacement, in a dynamically allocated string if possible
+        for (i = 0; i < sizeof hay; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            hay[i] = "ab"[(seed >> 16) % 2];
+        }
+        for (f = 0; f < sizeof froms / sizeof froms[0]; ++f) {
+            for (t = 0; t < sizeof tos / sizeof tos[0]; ++t) {
+                for (i = 0; i < sizeof hay + 11; i += 11) {
+                    size_t pos = i;
+                    const size_t len =
+                        naive_replace(expect, hay, sizeof hay, froms[f], tos[t], &count, &pos);
+#if STRB_FREESTANDING
+                    s = strb_use(&state, sizeof array, array);
+#else
+                    s = strb_alloc(16);
+                    assert(s);
+#endif
+                    assert(strb_write(s, sizeof hay));
+                    memcpy(strb_ptr(s), hay, sizeof hay);
+                    assert(!strb_seek(s, i));
+                    assert(strb_replace_all(s, froms[f], tos[t]) == count);
+                    assert(!strb_error(s));
+                    assert(strb_len(s) == len);
+                    assert(!memcmp(strb_cptr(s), expect, len));
+                    assert(strb_tell(s) == pos);
+#if STRB_HASH
+                    CHECK_HASH(s);
+#endif
+#if !STRB_FREESTANDING
+                    strb_free(s);
+#endif
+                }
+            }
+        }
+
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+        {
+            // Clones sharing a buffer get their own copy first
+            strb_t *const orig = strb_alloc(1000), *clone;
+
+            assert(orig);
+            assert(!strb_puts(orig, "a-b-c"));
+            clone = strb_clone(orig);
+            assert(clone);
+            assert(!strb_seek(clone, 0));
+            assert(strb_replace_all(clone, "-", "--") == 2);
+            assert(!strcmp(strb_cptr(clone), "a--b--c"));
+            assert(!strcmp(strb_cptr(orig), "a-b-c"));
+            strb_free(clone);
+            strb_free(orig);
+        }
+        {
+            // A duplicate is positioned at the end, but the whole string is searched
+            strb_t *const dup = strb_dup("a-b-c");
+
+            assert(dup);
+            assert(strb_tell(dup) == 5);
+            assert(strb_replace_all(dup, "-", "+-") == 2);
+            assert(!strcmp(strb_cptr(dup), "a+-b+-c"));
+            assert(strb_tell(dup) == 7);
+            assert(!strb_puts(dup, "-d"));
+            assert(strb_replace_all(dup, "+-", "") == 2);
+            assert(!strcmp(strb_cptr(dup), "abc-d"));
+            assert(strb_tell(dup) == 5);
+            strb_free(dup);
+        }
+#endif
+    }
+
+#if STRB_RESTORE
+    {
+        // Splitting strings into fields, with or without terminating each one
+        static const char *const sets[] = {"", ",", ", ", ",; \t", ",;: \t."};
+        char hay[120];
+        unsigned int seed = 1;
+        strb_tok_t it;
+        size_t i, d, start, end;
+        int terminate;
+
+        s = strb_use(&state, sizeof array, array);
+        assert(!strb_puts(s, ",,ab,,c d,"));
+        assert(!strb_seek(s, 0));
+        strb_tok_init(&it, false);
+        assert(!it.ptr);
+        assert(!strb_tok_next(s, &it, ", "));
+        assert(it.ptr == strb_cptr(s) + 2 && it.len == 2);
+        assert(strb_tell(s) == 4);
+        assert(!strb_tok_next(s, &it, ",")); // delimiters can differ between fields
+        assert(it.ptr == strb_cptr(s) + 6 && it.len == 3);
+        assert(strb_tok_next(s, &it, ",") == EOF);
+        assert(!it.ptr && !it.len);
+        assert(strb_tell(s) == strb_len(s));
+        assert(!strb_error(s));
+
+        assert(!strb_seek(s, 0));
+        strb_tok_init(&it, true);
+        assert(!strb_tok_next(s, &it, ", "));
+        assert(!strcmp(it.ptr, "ab"));
+        assert(!strb_tok_next(s, &it, ", "));
+        assert(!strcmp(it.ptr, "c"));
+        assert(strb_len(s) == 10);
+        assert(!strcmp(strb_cptr(s) + 4, ",,c"));
+        assert(!strb_tok_next(s, &it, ", "));
+        assert(!strcmp(it.ptr, "d"));
+        assert(strb_tok_next(s, &it, ", ") == EOF);
+        assert(!strcmp(strb_cptr(s), ",,ab,,c d,")); // every delimiter was put back
+
+        // Abandon tokenizing after one field
+        assert(!strb_seek(s, 0));
+        strb_tok_init(&it, true);
+        assert(!strb_tok_next(s, &it, ","));
+        assert(!strcmp(it.ptr, "ab"));
+        strb_restore(s);
+        assert(!strcmp(strb_cptr(s), ",,ab,,c d,"));
+
+        // Compare with a naive search, using long fields and more delimiters than are
+        // compared with whole words
+        for (i = 0; i < sizeof hay; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            hay[i] = "abcdefgh,; \t:."[(seed >> 16) % (i % 40 < 20 ? 8 : 14)];
+        }
+        for (terminate = 0; terminate < 2; ++terminate) {
+            for (d = 0; d < sizeof sets / sizeof sets[0]; ++d) {
+                s = strb_use(&state, sizeof array, array);
+                assert(strb_write(s, sizeof hay));
+                memcpy(strb_ptr(s), hay, sizeof hay);
+                assert(!strb_seek(s, 0));
+                strb_tok_init(&it, terminate);
+
+                for (start = 0;; start = end) {
+                    while (start < sizeof hay && strchr(sets[d], hay[start]))
+                        ++start;
+                    if (start == sizeof hay)
+                        break;
+                    for (end = start + 1; end < sizeof hay && !strchr(sets[d], hay[end]); ++end)
+                        ;
+
+                    assert(!strb_tok_next(s, &it, sets[d]));
+                    assert(it.ptr == strb_cptr(s) + start);
+                    assert(it.len == end - start);
+                    assert(!memcmp(it.ptr, hay + start, it.len));
+                    assert(strb_tell(s) == end);
+                    assert(!terminate || end == sizeof hay || !it.ptr[it.len]);
+                }
+                assert(strb_tok_next(s, &it, sets[d]) == EOF);
+                assert(strb_len(s) == sizeof hay);
+                assert(!memcmp(strb_cptr(s), hay, sizeof hay));
+#if STRB_HASH
+                CHECK_HASH(s);
+#endif
+            }
+        }
+
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+        {
+            // Clones sharing a buffer get their own copy before a field is terminated
+            strb_t *const orig = strb_alloc(1000), *clone;
+
+            assert(orig);
+            assert(!strb_puts(orig, "a b"));
+            clone = strb_clone(orig);
+            assert(clone);
+            assert(!strb_seek(clone, 0));
+            strb_tok_init(&it, true);
+            assert(!strb_tok_next(clone, &it, " "));
+            assert(!strcmp(it.ptr, "a"));
+            assert(it.ptr == strb_cptr(clone));
+            assert(!strcmp(strb_cptr(orig), "a b"));
+            assert(!strb_tok_next(clone, &it, " "));
+            assert(!strcmp(it.ptr, "b"));
+            assert(strb_tok_next(clone, &it, " ") == EOF);
+            assert(!strcmp(strb_cptr(clone), "a b"));
+            strb_free(clone);
+            strb_free(orig);
+        }
+#endif
+    }
+#endif
+
+#if STRB_LINES
+    {
+        // Seeking by line number, and updating or discarding the index of lines
+        unsigned int seed = 1;
+        size_t i, line, pos;
+
+        s = strb_alloc(0);
+        assert(s);
+        assert(!strb_puts(s, "one\ntwo\n\nfour"));
+        assert(!strb_seekline(s, 2));
+        assert(strb_tell(s) == 8);
+        assert(!strb_seekline(s, 0));
+        assert(strb_tell(s) == 0);
+        assert(!strb_seekline(s, 3));
+        assert(strb_tell(s) == 9);
+        assert(strb_seekline(s, 4) == EOF);
+        assert(strb_tell(s) == 9);
+        assert(!strb_error(s));
+        assert(strb_lineof(s, 0) == 0);
+        assert(strb_lineof(s, 3) == 0);
+        assert(strb_lineof(s, 4) == 1);
+        assert(strb_lineof(s, 8) == 2);
+        assert(strb_lineof(s, 100) == 3);
+
+        // Appending after the indexed characters
+        assert(!strb_seek(s, strb_len(s)));
+        assert(!strb_puts(s, "\nfive\n"));
+        assert(!strb_seekline(s, 5));
+        assert(strb_tell(s) == strb_len(s)); // the last line is empty
+        assert(strb_lineof(s, 14) == 4);
+
+        // Changing characters before the end of the index
+        assert(!strb_seek(s, 1));
+        assert(!strb_puts(s, "\n"));
+        assert(!strb_seekline(s, 1));
+        assert(strb_tell(s) == 2);
+        assert(strb_lineof(s, strb_len(s)) == 6);
+        assert(!strb_seek(s, 3));
+        strb_delto(s, 5);
+        assert(!strcmp(strb_cptr(s), "o\nntwo\n\nfour\nfive\n"));
+        assert(strb_lineof(s, strb_len(s)) == 5);
+        assert(!strb_seekline(s, 2));
+        assert(strb_tell(s) == 7);
+        assert(strb_putc(s, '\n') == '\n');
+        assert(strb_lineof(s, strb_len(s)) == 6);
+        assert(strb_unputc(s) == '\n');
+        assert(strb_lineof(s, strb_len(s)) == 5);
+        strb_ptr(s)[0] = '\n'; // the caller may change anything
+        assert(strb_lineof(s, 1) == 1);
+        assert(!strb_seekline(s, 6));
+        assert(strb_tell(s) == strb_len(s));
+        assert(!strb_cpy(s, ""));
+        assert(strb_lineof(s, 0) == 0);
+        assert(strb_seekline(s, 1) == EOF);
+
+        // Compare with a naive count after random edits in both modes
+        for (i = 0; i < 200; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            pos = (seed >> 16) % (strb_len(s) + 1);
+            assert(!strb_seek(s, pos));
+            assert(!strb_setmode(s, i % 5 ? strb_insert : strb_overwrite));
+            if ((seed >> 8) % 4 || strb_len(s) > 150) {
+                if (strb_len(s) < 200)
+                    assert(!strb_puts(s, "ab\nc\n" + (seed >> 4) % 6));
+            } else {
+                strb_delto(s, pos + (seed >> 4) % 8);
+            }
+            assert(!strb_error(s));
+
+            pos = (seed >> 12) % (strb_len(s) + 2);
+            assert(strb_lineof(s, pos) ==
+                   count_chars(strb_cptr(s), pos < strb_len(s) ? pos : strb_len(s), '\n'));
+
+            line = (seed >> 20) % 8;
+            if (strb_seekline(s, line) == EOF) {
+                assert(count_chars(strb_cptr(s), strb_len(s), '\n') < line);
+            } else {
+                pos = strb_tell(s);
+                assert(pos == 0 || strb_cptr(s)[pos - 1] == '\n');
+                assert(count_chars(strb_cptr(s), pos, '\n') == line);
+            }
+        }
+        assert(!strb_setmode(s, strb_insert));
+        strb_free(s); // releases the index
+
+        // Enough newlines to overflow the count in a byte
+        s = strb_alloc(0);
+        assert(s);
+        for (i = 0; i < 10000; ++i)
+            assert(strb_putc(s, i % 3 ? '\n' : 'x') != EOF);
+        assert(strb_lineof(s, SIZE_MAX) == 6666);
+        assert(!strb_seekline(s, 6666));
+        assert(strb_tell(s) == 9999);
+        assert(!strb_seekline(s, 1000));
+        assert(strb_tell(s) == 1500);
+        strb_free(s);
+
+        // Strings that need not be freed are scanned instead of indexed, which the leak
+        // sanitizer would otherwise report
+        {
+            _Optional const strb_t *cs = strb_reuse_const(&state, "a\nb\nc");
+            _Optional strbintern_t *const table = strb_intern_alloc();
+
+            assert(cs);
+            assert(strb_lineof(cs, 5) == 2);
+            assert(strb_lineof(cs, 2) == 1);
+
+            s = strb_use(&state, sizeof array, array);
+            assert(!strb_puts(s, "a\nb\nc"));
+            assert(!strb_seekline(s, 2));
+            assert(strb_tell(s) == 4);
+            assert(!strb_seekline(s, 0));
+            assert(strb_tell(s) == 0);
+            assert(strb_seekline(s, 3) == EOF);
+            assert(strb_tell(s) == 0);
+            assert(strb_lineof(s, 3) == 1);
+
+            assert(table);
+            cs = strb_intern(table, "x\ny", 3);
+            assert(cs);
+            assert(strb_lineof(cs, 3) == 1);
+            strb_intern_free(table);
+        }
+    }
+#endif
+
+#if STRB_HASH
+    {
+        // Hashing strings, and updating or discarding the cached hash
+        const uint64_t empty = fresh_hash("", 0);
+        uint64_t h;
+
+        s = strb_alloc(128);
+        assert(s);
+        assert(strb_hash(s) == empty);
+        assert(!strb_puts(s, "The quick brown fox"));
+        h = strb_hash(s);
+        assert(h != empty);
+        assert(strb_hash(s) == h);
+        assert(h == fresh_hash("The quick brown fox", 19));
+        assert(h != fresh_hash("The quick brown fix", 19));
+        assert(h != fresh_hash("The quick brown fox\0", 20));
+        assert(!strb_puts(s, " jumps over the lazy dog")); // hashed incrementally
+        CHECK_HASH(s);
+        assert(strb_putc(s, '.') == '.');
+        CHECK_HASH(s);
+
+        assert(!strb_seek(s, 4));
+        assert(!strb_puts(s, "very ")); // inserted
+        CHECK_HASH(s);
+        assert(!strcmp(strb_cptr(s), "The very quick brown fox jumps over the lazy dog."));
+
+        assert(!strb_setmode(s, strb_overwrite));
+        assert(!strb_seek(s, 0));
+        assert(strb_putc(s, 't') == 't');
+        CHECK_HASH(s);
+#if STRB_UNPUTC
+        assert(strb_unputc(s) == 't');
+        CHECK_HASH(s);
+        assert(!strb_seek(s, strb_len(s)));
+        assert(strb_putc(s, '!') == '!');
+        assert(strb_unputc(s) == '!');
+        CHECK_HASH(s);
+#endif
+        assert(!strb_setmode(s, strb_insert));
+#if STRB_UNPUTC
+        assert(!strb_seek(s, 10));
+        assert(strb_putc(s, 'x') == 'x');
+        assert(strb_unputc(s) == 'x');
+        CHECK_HASH(s);
+#endif
+
+        assert(!strb_seek(s, 4));
+        strb_delto(s, 9);
+        CHECK_HASH(s);
+        assert(!strcmp(strb_cptr(s), "The quick brown fox jumps over the lazy dog."));
+
+        assert(!strb_seek(s, 3));
+        strb_split(s);
+        CHECK_HASH(s);
+        assert(!strcmp(strb_cptr(s), "The"));
+#if STRB_RESTORE
+        strb_restore(s);
+        CHECK_HASH(s);
+        assert(!strcmp(strb_cptr(s), "The quick brown fox jumps over the lazy dog."));
+#endif
+
+        h = strb_hash(s);
+        strb_ptr(s)[0] = 't'; // modified through a pointer
+        assert(strb_hash(s) != h);
+        CHECK_HASH(s);
+
+        assert(!strb_seek(s, strb_len(s) + 3));
+        assert(strb_putc(s, '?') == '?'); // zero-filled first
+        CHECK_HASH(s);
+
+        assert(!strb_cpy(s, "short"));
+        CHECK_HASH(s);
+        assert(strb_hash(s) == fresh_hash("short", 5));
+        strb_free(s);
+
+        // No hash is cached for a caller's array, which can be modified directly
+        s = strb_use(&state, 128, array);
+        assert(!strb_puts(s, "The quick brown fox"));
+        h = strb_hash(s);
+        array[0] = 't';
+        assert(strb_hash(s) != h);
+        CHECK_HASH(s);
+        assert(!strb_puts(s, " jumps"));
+        CHECK_HASH(s);
+    }
+#endif
+
 #if STRB_REUSE_CONST
     {
         _Optional const strb_t *cs = strb_reuse_const(&state, "Cyclist");
@@ -326,6 +1076,9 @@ int main(void)
         assert(strb_tell(cs) == strlen("Cyclist"));
         assert(strb_len(cs) == strlen("Cyclist"));
         assert(!strcmp(strb_cptr(cs), "Cyclist"));
+#if STRB_HASH
+        CHECK_HASH(cs);
+#endif
         puts(strb_cptr(cs));
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
         puts(strb_ptr(cs));
@@ -338,8 +1091,116 @@ int main(void)
         puts(strb_cptr(cs));
 #endif
     }
+
+#if STRB_POSIX
+    {
+        // Mapping files, including one that fills a page with no terminator
+        const long page = sysconf(_SC_PAGESIZE);
+        char path[] = "/tmp/strbtestXXXXXX";
+        int fd = mkstemp(path);
+        _Optional const strb_t *cs;
+        long i;
+
+        assert(fd >= 0);
+        cs = strb_map_file(&state, path);
+        assert(cs);
+        assert(strb_len(cs) == 0);
+        assert(!strcmp(strb_cptr(cs), ""));
+        strb_free((strb_t *)cs);
+
+        assert(write(fd, "mapped\0file", 11) == 11);
+        cs = strb_map_file(&state, path);
+        assert(cs);
+        assert(strb_len(cs) == 11);
+        assert(strb_tell(cs) == 11);
+        assert(!memcmp(strb_cptr(cs), "mapped\0file", 12));
+        assert(!strb_error(cs));
+        strb_free((strb_t *)cs);
+
+        for (i = 11; i < page; ++i)
+            assert(write(fd, "p", 1) == 1);
+        close(fd);
+        cs = strb_map_file(&state, path);
+        if ((size_t)page < STRB_MAX_SIZE - 1) {
+            assert(cs);
+            assert(strb_len(cs) == (size_t)page);
+            assert(strb_cptr(cs)[page - 1] == 'p');
+            assert(strb_cptr(cs)[page] == '\0');
+            strb_free((strb_t *)cs);
+        } else {
+            assert(!cs); // too big
+        }
+        unlink(path);
+        assert(!strb_map_file(&state, path));
+    }
+#endif
 #endif // STRB_REUSE_CONST
 
+#if STRB_POSIX
+    {
+        // Putting no characters from the start of a page that can't be read
+        const long page = sysconf(_SC_PAGESIZE);
+        char *const pages = mmap(NULL, (size_t)page * 2, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        strbspan_t span;
+
+        assert(pages != MAP_FAILED);
+        assert(!mprotect(pages + page, (size_t)page, PROT_NONE));
+        span.ptr = pages + page;
+        span.len = 0;
+
+        s = strb_use(&state, sizeof array, array);
+        assert(!strb_puts(s, "guard"));
+        assert(!strb_nputs(s, pages + page, 0));
+        assert(!strb_nputsv(s, &span, 1));
+        assert(!strcmp(strb_cptr(s), "guard"));
+        assert(!strb_error(s));
+        assert(!munmap(pages, (size_t)page * 2));
+    }
+#endif
+
+    {
+        // Appending until the external array is full
+        char small[4];
+        s = strb_use(&state, sizeof small, small);
+        assert(strb_putc(s, 'a') == 'a');
+        assert(!strb_puts(s, "b"));
+        assert(strb_putc(s, 'c') == 'c');
+        assert(!strcmp(small, "abc"));
+        assert(!strb_error(s));
+
+        assert(strb_putc(s, 'd') == EOF);
+        assert(strb_error(s));
+        strb_clearerr(s);
+        assert(strb_puts(s, "d") == EOF);
+        assert(strb_error(s));
+        strb_clearerr(s);
+        assert(!strb_puts(s, ""));
+        {
+            static const char *const strs[] = {"", "d"};
+            static const strbspan_t spans[] = {{"", 1}, {"de", 1}};
+            assert(strb_putsv(s, strs, 2) == EOF);
+            assert(strb_error(s));
+            strb_clearerr(s);
+            assert(strb_nputsv(s, spans, 2) == EOF);
+            assert(strb_error(s));
+            strb_clearerr(s);
+            assert(!strb_nputsv(s, spans, 1));
+        }
+        assert(!strcmp(small, "abc"));
+        assert(strb_len(s) == 3);
+        assert(strb_tell(s) == 3);
+#if STRB_UNPUTC
+        assert(strb_unputc(s) == 'c');
+        assert(strb_putc(s, 'e') == 'e');
+        assert(strb_unputc(s) == 'e');
+        assert(!strcmp(small, "ab"));
+        assert(!strb_puts(s, "f"));
+        assert(!strcmp(small, "abf"));
+#endif
+        assert(!strb_error(s));
+    }
+
 #elif !STRB_FREESTANDING
     s = strb_use(sizeof array, array);
 #if STRB_UNPUTC
@@ -471,6 +1332,835 @@ int main(void)
 #endif
     strb_free(s);
 
+    s = strb_alloc(0);
+    test_fmt(s);
+    strb_free(s);
+
+    s = strb_dup("head tail");
+    assert(!strb_seek(s, strlen("head ")));
+    assert(!strb_putf(s, "%0150d ", 7)); // inserted output too long for a scratch array
+    assert(strb_len(s) == strlen("head tail") + 151);
+    assert(strb_tell(s) == strlen("head ") + 151);
+    assert(!strncmp(strb_ptr(s), "head 000", 8));
+    assert(!strcmp(strb_ptr(s) + strlen("head ") + 148, "07 tail"));
+
+    assert(!strb_setmode(s, strb_overwrite));
+    assert(!strb_seek(s, 0));
+    assert(!strb_putf(s, "%s", "HEAD"));
+    assert(strb_len(s) == strlen("head tail") + 151);
+    assert(!strncmp(strb_ptr(s), "HEAD 000", 8));
+    puts(strb_ptr(s));
+    strb_free(s);
+
+#if STRB_MAX_SIZE > 512
+    s = strb_alloc(0);
+    assert(!strb_putf(s, "%0200d", 1)); // appended output fits in place
+    assert(!strb_putf(s, "%0200d", 2)); // appended output needs a bigger buffer
+    assert(strb_len(s) == 400);
+    assert(strb_ptr(s)[199] == '1');
+    assert(strb_ptr(s)[399] == '2');
+    assert(strb_ptr(s)[400] == '\0');
+    strb_free(s);
+
+    s = strb_aprintf("%0200d", 3); // output too long for a scratch array
+    assert(strb_len(s) == 200);
+    assert(strb_ptr(s)[199] == '3');
+    assert(strb_ptr(s)[200] == '\0');
+    strb_free(s);
+#endif
+
+    s = strb_dup("reserve");
+    assert(!strb_reserve(s, 3)); // already big enough
+#if !STRB_STATIC_ALLOC
+    assert(!strb_reserve(s, 1000));
+    {
+        const char *const p = strb_ptr(s);
+        assert(strb_nputc(s, '!', 1000 - strlen("reserve")) == '!');
+        assert(strb_ptr(s) == p); // no further allocation
+    }
+    {
+        // Reserving less than the position beyond the end
+        strb_t *const t = strb_alloc(0);
+
+        assert(t);
+        assert(!strb_seek(t, 1000));
+        assert(!strb_reserve(t, 500));
+        assert(strb_tell(t) == 1000);
+        assert(strb_putc(t, 'x') == 'x');
+        assert(strb_len(t) == 1001);
+        assert(!strb_error(t));
+        strb_free(t);
+    }
+#endif
+    assert(!strb_error(s));
+    assert(strb_reserve(s, STRB_MAX_SIZE) == EOF);
+    assert(strb_error(s));
+    strb_clearerr(s);
+
+    assert(!strb_seek(s, 3));
+    strb_delto(s, SIZE_MAX);
+    strb_shrink_to_fit(s);
+    assert(!strcmp(strb_ptr(s), "res"));
+    assert(strb_tell(s) == 3);
+    assert(!strb_puts(s, "ize"));
+    assert(!strcmp(strb_ptr(s), "resize"));
+    assert(!strb_error(s));
+    strb_free(s);
+
+    {
+        // More fragments than strb_putsv measures in one batch
+        static const char *const digits[] = {
+            "0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+            "a", "b", "c", "d", "e", "f", "g", "h", "i", "j"
+        };
+        s = strb_dup("<>");
+        assert(!strb_seek(s, 1));
+        assert(!strb_putsv(s, digits, sizeof digits / sizeof digits[0]));
+        assert(!strcmp(strb_ptr(s), "<0123456789abcdefghij>"));
+        assert(strb_tell(s) == 21);
+        strb_free(s);
+    }
+
+    {
+        // Writing strings out, including one that may be split by a gap
+        strb_t *out[3];
+        char got[64];
+        FILE *f = tmpfile();
+        int i;
+
+        assert(f);
+        out[0] = strb_dup("alpha ");
+        out[1] = strb_dup("gama");
+        out[2] = strb_alloc(0);
+        assert(out[0] && out[1] && out[2]);
+        assert(!strb_seek(out[1], 2));
+        assert(strb_putc(out[1], 'm') == 'm');
+
+        for (i = 0; i < 3; ++i)
+            assert(!strb_fwrite(out[i], f));
+        rewind(f);
+        assert(fread(got, 1, sizeof got, f) == strlen("alpha gamma"));
+        assert(!strncmp(got, "alpha gamma", strlen("alpha gamma")));
+        fclose(f);
+
+#if STRB_POSIX
+        {
+            strb_t *many[300];
+            int fds[2];
+            size_t total = 0;
+            ssize_t n;
+
+            assert(!pipe(fds));
+            assert(!strb_write_fd(out[1], fds[1]));
+            assert(!strb_writev_fd(fds[1], out, 3));
+            for (i = 0; i < 300; ++i)
+                many[i] = out[i % 2];
+            assert(!strb_writev_fd(fds[1], many, 300)); // more than one call to writev
+            assert(!strb_writev_fd(fds[1], many, 0));
+            close(fds[1]);
+
+            n = read(fds[0], got, strlen("gammaalpha gamma"));
+            assert(n == (ssize_t)strlen("gammaalpha gamma"));
+            assert(!strncmp(got, "gammaalpha gamma", (size_t)n));
+            while ((n = read(fds[0], got, sizeof got)) > 0)
+                total += (size_t)n;
+            assert(total == 150 * strlen("alpha gamma"));
+            close(fds[0]);
+
+            assert(strb_write_fd(out[0], -1) == EOF);
+            assert(!strcmp(strb_ptr(out[1]), "gamma"));
+        }
+#endif
+        for (i = 0; i < 3; ++i)
+            strb_free(out[i]);
+    }
+
+    {
+        // Reading into strings at the end and in the middle
+        static const char data[] = "hello\0world";
+        FILE *f = tmpfile();
+        int i;
+
+        assert(f);
+        assert(fwrite(data, 1, sizeof data - 1, f) == sizeof data - 1);
+        rewind(f);
+        s = strb_alloc(0);
+        assert(!strb_fread(s, f, SIZE_MAX));
+        assert(strb_len(s) == sizeof data - 1);
+        assert(!memcmp(strb_ptr(s), data, sizeof data));
+        strb_free(s);
+
+        rewind(f);
+        s = strb_dup("[]");
+        assert(!strb_seek(s, 1));
+        assert(!strb_fread(s, f, 5));
+        assert(!strcmp(strb_ptr(s), "[hello]"));
+        assert(strb_tell(s) == 6);
+        assert(!strb_fread(s, f, 0));
+        strb_free(s);
+
+        rewind(f);
+        for (i = 0; i < 1000; ++i)
+            assert(fputs("0123456789", f) >= 0);
+        rewind(f);
+        s = strb_alloc(0);
+#if STRB_STATIC_ALLOC
+        assert(strb_fread(s, f, SIZE_MAX) == EOF); // too long for a fixed-size buffer
+        assert(strb_error(s));
+        assert(strb_len(s) == STRB_MAX_SIZE - 1);
+#else
+        assert(!strb_fread(s, f, SIZE_MAX));
+        assert(strb_len(s) == 10000);
+        assert(!strncmp(strb_ptr(s) + 9990, "0123456789", 11));
+#endif
+        strb_free(s);
+
+#if !STRB_STATIC_ALLOC && STRB_MAX_SIZE <= UINT16_MAX
+        {
+            // A full buffer too near the maximum size to grow by a whole chunk
+            char *const big = malloc(STRB_MAX_SIZE - 100);
+
+            assert(big);
+            memset(big, 'x', STRB_MAX_SIZE - 101);
+            big[STRB_MAX_SIZE - 101] = '\0';
+            s = strb_dup(big);
+            free(big);
+            assert(s);
+            strb_shrink_to_fit(s);
+            assert(!fseek(f, -50, SEEK_END));
+            assert(!strb_fread(s, f, SIZE_MAX));
+            assert(strb_len(s) == STRB_MAX_SIZE - 51);
+            assert(!strcmp(strb_ptr(s) + STRB_MAX_SIZE - 61, "0123456789"));
+            rewind(f);
+            assert(strb_fread(s, f, SIZE_MAX) == EOF); // no room left at all
+            assert(strb_error(s));
+            assert(strb_len(s) == STRB_MAX_SIZE - 1);
+            strb_free(s);
+        }
+#endif
+        fclose(f);
+
+#if STRB_POSIX
+        {
+            char path[] = "/tmp/strbtestXXXXXX";
+            const int fd = mkstemp(path);
+            int fds[2];
+
+            assert(fd >= 0);
+            assert(write(fd, "config=1\n", 9) == 9);
+            close(fd);
+
+            s = strb_dup("# ");
+            assert(!strb_readfile(s, path));
+            assert(!strcmp(strb_ptr(s), "# config=1\n"));
+            strb_free(s);
+
+            s = strb_alloc(0);
+            assert(!strb_puts(s, "> "));
+            assert(!strb_seek(s, 0));
+            assert(!strb_readfile(s, path));
+            assert(!strcmp(strb_ptr(s), "config=1\n> "));
+            assert(strb_tell(s) == 9);
+            strb_free(s);
+            unlink(path);
+
+            s = strb_dup("unchanged");
+            assert(strb_readfile(s, path) == EOF);
+            assert(!strb_error(s));
+            assert(!strcmp(strb_ptr(s), "unchanged"));
+
+            assert(!pipe(fds));
+            assert(write(fds[1], "piped", 5) == 5);
+            close(fds[1]);
+            assert(!strb_read_fd(s, fds[0], 3));
+            assert(!strcmp(strb_ptr(s), "unchangedpip"));
+            assert(!strb_read_fd(s, fds[0], SIZE_MAX));
+            assert(!strcmp(strb_ptr(s), "unchangedpiped"));
+            close(fds[0]);
+            assert(strb_read_fd(s, -1, SIZE_MAX) == EOF);
+            assert(!strb_error(s));
+            strb_free(s);
+        }
+#endif
+    }
+
+#if STRB_FOPEN
+    {
+        // Standard I/O functions writing into and reading from a string
+        _Optional FILE *f;
+        char got[16];
+
+        s = strb_dup("[]");
+        assert(!strb_seek(s, 1));
+        f = strb_fopen(s, "w+");
+        assert(f);
+        assert(fprintf(f, "%d-%s", 42, "x") == 4);
+        assert(!fflush(f));
+        assert(!strcmp(strb_ptr(s), "[42-x]"));
+
+        assert(fputs("yz", f) >= 0);
+        assert(fputc('!', f) == '!');
+        assert(!fflush(f));
+        assert(!strcmp(strb_ptr(s), "[42-xyz!]"));
+        assert(ftell(f) == 8);
+        assert(strb_tell(s) == 8);
+
+        assert(strb_setmode(s, strb_overwrite) == strb_insert);
+        assert(!fseek(f, 1, SEEK_SET));
+        assert(fwrite("OVER", 1, 4, f) == 4);
+        assert(!fflush(f));
+        assert(!strcmp(strb_ptr(s), "[OVERyz!]"));
+        assert(fgets(got, sizeof got, f));
+        assert(!strcmp(got, "yz!]"));
+        assert(fgetc(f) == EOF);
+        assert(fseek(f, -10, SEEK_END));
+        assert(!fclose(f));
+        strb_free(s);
+
+#if STRB_STATIC_ALLOC
+        s = strb_alloc(0);
+        f = strb_fopen(s, "w");
+        assert(f);
+        assert(fprintf(f, "%300d", 1) == 300);
+        assert(fflush(f) == EOF); // too long for a fixed-size buffer
+        assert(ferror(f));
+        assert(strb_error(s));
+        assert(strb_len(s) == 0);
+        fclose(f);
+        strb_free(s);
+#endif
+    }
+#endif
+
+#if !STRB_STATIC_ALLOC
+    {
+        strbgrowth_t policy = {150, 64, 4096}, old;
+
+        strb_getgrowth(&old);
+        assert(old.percent == STRB_GROW_FACTOR * 100);
+        assert(!old.max_step);
+        assert(!old.granularity);
+        strb_setgrowth(&policy);
+
+        s = strb_alloc(0);
+        assert(strb_nputc(s, 'g', 5000) == 'g');
+        assert(strb_len(s) == 5000);
+        assert(strb_ptr(s)[4999] == 'g');
+        strb_free(s);
+
+        policy.percent = 0; // grow only as much as needed
+        strb_setgrowth(&policy);
+        s = strb_dup("exact");
+        assert(!strb_puts(s, " fit"));
+        assert(!strcmp(strb_ptr(s), "exact fit"));
+        strb_free(s);
+
+        strb_setgrowth(NULL);
+        strb_getgrowth(&policy);
+        assert(policy.percent == old.percent);
+        assert(!policy.max_step);
+        assert(!policy.granularity);
+    }
+
+    {
+        // Moving strings into and out of string buffers
+        strbstate_t state;
+        char array[8];
+        _Optional char *d, *m;
+        size_t n;
+
+        s = strb_dup("internal");
+        d = strb_detach(s, &n);
+        assert(d);
+        assert(n == strlen("internal"));
+        assert(!strcmp(d, "internal"));
+        free(d);
+
+        s = strb_alloc(1000);
+        assert(!strb_puts(s, "ac"));
+        assert(!strb_seek(s, 1));
+        assert(strb_putc(s, 'b') == 'b');
+        d = strb_detach(s, NULL);
+        assert(d);
+        assert(!strcmp(d, "abc"));
+        free(d);
+
+        s = strb_use(&state, sizeof array, array);
+        assert(!strb_puts(s, "array"));
+        d = strb_detach(s, &n);
+        assert(d && d != array);
+        assert(n == 5);
+        assert(!strcmp(d, "array"));
+
+        s = strb_adopt(d, 6, 5);
+        assert(s);
+        assert(strb_len(s) == 5);
+        assert(strb_tell(s) == 5);
+        assert(strb_unputc(s) == 'y');
+        assert(!strb_puts(s, "ys and more"));
+        assert(!strcmp(strb_ptr(s), "arrays and more"));
+        d = strb_detach(s, &n);
+        assert(d);
+        assert(!strcmp(d, "arrays and more"));
+
+        s = strb_adopt(d, n + 1, n);
+        assert(s);
+        strb_free(s);
+
+#if !STRB_LARGE
+        m = calloc((size_t)STRB_MAX_SIZE + 1, 1);
+        assert(m);
+        assert(!strb_adopt(m, (size_t)STRB_MAX_SIZE + 1, STRB_MAX_SIZE)); // too long
+        s = strb_adopt(m, (size_t)STRB_MAX_SIZE + 1, 0);
+        assert(s);
+        strb_free(s);
+#else
+        (void)m;
+#endif
+    }
+#endif
+
+#if !STRB_FREESTANDING
+    {
+        // Cloning strings, sharing allocated buffers until modified
+        _Optional strb_t *c, *c2;
+        strbstate_t state;
+        char array[16];
+
+        s = strb_alloc(1000); // too big for an internal buffer
+        assert(!strb_puts(s, "shared"));
+        c = strb_clone(s);
+        assert(c);
+        assert(strb_len(c) == 6);
+        assert(strb_tell(c) == 6);
+        assert(!strcmp(strb_cptr(c), "shared"));
+#if !STRB_STATIC_ALLOC
+        assert(strb_cptr(c) == strb_cptr(s));
+#endif
+        c2 = strb_clone(c);
+        assert(c2);
+        assert(!strb_puts(c, " by c"));
+        assert(!strcmp(strb_cptr(c), "shared by c"));
+        assert(!strcmp(strb_cptr(s), "shared"));
+#if STRB_HASH
+        assert(strb_hash(c2) == strb_hash(s));
+        CHECK_HASH(c);
+#endif
+        assert(!strcmp(strb_cptr(c2), "shared"));
+        assert(strb_unputc(c2) == 'd');
+        assert(!strcmp(strb_cptr(c2), "share"));
+        assert(!strcmp(strb_cptr(s), "shared"));
+        assert(!strb_puts(s, " by s")); // last user of the buffer reclaims it
+        assert(!strcmp(strb_cptr(s), "shared by s"));
+        strb_free(c2);
+        strb_free(c);
+
+        c = strb_clone(s);
+        assert(c);
+        strb_free(s); // freed in the opposite order
+        assert(!strcmp(strb_cptr(c), "shared by s"));
+        s = c;
+
+        c = strb_clone(s);
+        assert(c);
+        assert(!strb_seek(c, 2));
+        strb_delto(c, 7);
+        assert(!strcmp(strb_cptr(c), "shby s"));
+        assert(!strcmp(strb_cptr(s), "shared by s"));
+        strb_free(c);
+
+        c = strb_clone(s);
+        assert(c);
+        assert(!strb_setmode(c, strb_overwrite));
+        assert(!strb_seek(c, 0));
+        assert(!strb_puts(c, "SH"));
+        assert(!strcmp(strb_cptr(c), "SHared by s"));
+        assert(!strcmp(strb_cptr(s), "shared by s"));
+        strb_free(c);
+
+        c = strb_clone(s);
+        assert(c);
+        assert(!strb_seek(c, 13));
+        assert(strb_putc(c, '!') == '!');
+        assert(strb_len(c) == 14);
+        assert(!memcmp(strb_cptr(c), "shared by s\0\0!", 15));
+        assert(!strcmp(strb_cptr(s), "shared by s"));
+        strb_free(c);
+
+        c = strb_clone(s);
+        assert(c);
+        assert(!strb_printf(c, "%d", 42));
+        assert(!strcmp(strb_cptr(c), "42"));
+        strb_ptr(s)[0] = 'S';
+        assert(!strcmp(strb_cptr(s), "Shared by s"));
+        strb_free(c);
+
+        c = strb_clone(s);
+        assert(c);
+#if !STRB_STATIC_ALLOC
+        {
+            _Optional char *d = strb_detach(c, NULL); // copied from the shared buffer
+            assert(d);
+            assert(!strcmp(d, "Shared by s"));
+            free(d);
+        }
+#else
+        strb_free(c);
+#endif
+        assert(!strcmp(strb_cptr(s), "Shared by s"));
+        strb_free(s);
+
+        s = strb_use(&state, sizeof array, array);
+        assert(!strb_puts(s, "array"));
+        c = strb_clone(s); // external buffers are copied
+        assert(c);
+        assert(strb_cptr(c) != array);
+        assert(!strcmp(strb_cptr(c), "array"));
+        assert(strb_unputc(c) == 'y');
+        assert(!strcmp(array, "array"));
+        strb_free(c);
+        strb_free(s);
+    }
+#endif
+
+#if !STRB_STATIC_ALLOC && !STRB_FREESTANDING
+    {
+        // Finding many patterns at once
+        static const char *const words[] = {"he", "she", "his", "hers", "", "he", "\xff\x80"};
+        static const char *const many[] = {"ab", "ba", "aab", "abab", "bbb", "a", "abaab", "bab"};
+        _Optional strbmatcher_t *m = strb_matcher_compile(words, sizeof words / sizeof words[0]);
+        matches_t found = {0, 0, {0}, {0}};
+        _Optional const strb_t *cs;
+        strbstate_t mstate;
+        char marray[256];
+        check_t check;
+        size_t i, j, expect;
+        unsigned int seed = 7;
+
+        assert(m);
+        cs = strb_reuse_const(&mstate, "ushers\xff\x80");
+        assert(cs);
+        assert(!strb_match_all(cs, m, record_match, &found));
+        assert(found.n == 5);
+        assert(found.pattern[0] == 1 && found.pos[0] == 1); // she
+        assert(found.pattern[1] == 5 && found.pos[1] == 2); // he (both copies)
+        assert(found.pattern[2] == 0 && found.pos[2] == 2);
+        assert(found.pattern[3] == 3 && found.pos[3] == 2); // hers
+        assert(found.pattern[4] == 6 && found.pos[4] == 6);
+
+        s = strb_use(&mstate, sizeof marray, marray);
+        assert(!strb_puts(s, "this and hers"));
+        assert(!strb_seek(s, 5)); // the position is ignored
+        found.n = 0;
+        found.stop_after = 2;
+        assert(strb_match_all(s, m, record_match, &found) == 42);
+        assert(found.n == 2);
+        assert(found.pattern[0] == 2 && found.pos[0] == 1); // his
+        assert(found.pattern[1] == 5 && found.pos[1] == 9); // he
+        assert(strb_tell(s) == 5);
+        strb_matcher_free(m);
+
+        m = strb_matcher_compile(words, 0);
+        assert(m);
+        assert(!strb_match_all(s, m, record_match, NULL)); // nothing to find
+        strb_matcher_free(m);
+        strb_matcher_free(NULL);
+
+        // Compare with a naive search, including overlapping occurrences
+        m = strb_matcher_compile(many, sizeof many / sizeof many[0]);
+        assert(m);
+        s = strb_alloc(2000);
+        assert(s);
+        for (i = 0; i < 2000; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            assert(strb_putc(s, "abbc"[(seed >> 16) % 4]) != EOF);
+        }
+        check.str = strb_cptr(s);
+        check.patterns = many;
+        check.n = 0;
+        assert(!strb_match_all(s, m, check_match, &check));
+
+        for (expect = 0, i = 0; i < sizeof many / sizeof many[0]; ++i) {
+            const size_t len = strlen(many[i]);
+
+            for (j = 0; j + len <= strb_len(s); ++j) {
+                if (!memcmp(strb_cptr(s) + j, many[i], len))
+                    ++expect;
+            }
+        }
+        assert(check.n == expect);
+        strb_matcher_free(m);
+        strb_free(s);
+    }
+#endif
+
+#if STRB_STATIC_ALLOC && STRB_INTERN_TABLES < 2
+    assert(!strb_intern_alloc()); // too few tables configured
+#elif !STRB_FREESTANDING
+    {
+        // Interning strings
+        _Optional strbintern_t *table = strb_intern_alloc(), *table2 = strb_intern_alloc();
+        _Optional const strb_t *a, *b, *e, *z;
+        char key[16];
+        size_t i, n;
+
+        assert(table);
+        assert(table2);
+        a = strb_intern(table, "alpha", 5);
+        assert(a);
+        assert(strb_len(a) == 5);
+        assert(!strcmp(strb_cptr(a), "alpha"));
+#if STRB_HASH
+        assert(strb_hash(a) == fresh_hash("alpha", 5));
+#endif
+        assert(strb_intern(table, "alphabet", 5) == a);
+        b = strb_intern(table, "alphabet", 8);
+        assert(b && b != a);
+        assert(!strcmp(strb_cptr(b), "alphabet"));
+#if STRB_HASH
+        assert(strb_hash(b) == fresh_hash("alphabet", 8));
+#endif
+        assert(strb_intern(table2, "alpha", 5) != a);
+
+        e = strb_intern(table, "", 0);
+        assert(e);
+        assert(!strb_len(e));
+        assert(!strcmp(strb_cptr(e), ""));
+        z = strb_intern(table, "a\0b", 3); // content may include nulls
+        assert(z && z != a && z != e);
+        assert(strb_len(z) == 3);
+        assert(!memcmp(strb_cptr(z), "a\0b", 4));
+        assert(strb_intern(table, "a\0b", 3) == z);
+        assert(strb_intern(table, "a\0c", 3) != z);
+        strb_free((strb_t *)a); // no effect
+        assert(!strcmp(strb_cptr(a), "alpha"));
+
+        // Fill the table (or grow it), then check everything is still unique
+        for (n = 0; n < 1000; ++n) {
+            snprintf(key, sizeof key, "key%zu", n);
+            if (!strb_intern(table, key, strlen(key)))
+                break;
+        }
+#if STRB_STATIC_ALLOC
+        assert(n < STRB_INTERN_MAX);
+#else
+        assert(n == 1000);
+#endif
+        for (i = 0; i < n; ++i) {
+            _Optional const strb_t *k;
+
+            snprintf(key, sizeof key, "key%zu", i);
+            k = strb_intern(table, key, strlen(key));
+            assert(k);
+            assert(!strcmp(strb_cptr(k), key));
+        }
+        assert(strb_intern(table, "alpha", 5) == a);
+        assert(strb_intern(table, "alphabet", 8) == b);
+        assert(strb_intern(table, "a\0b", 3) == z);
+
+#if !STRB_STATIC_ALLOC
+        {
+            // Long strings are allocated separately
+            char *const big = malloc(STRB_INTERN_CHUNK_SIZE * 2);
+            _Optional const strb_t *l;
+
+            assert(big);
+            memset(big, 'L', STRB_INTERN_CHUNK_SIZE * 2);
+            l = strb_intern(table, big, STRB_INTERN_CHUNK_SIZE * 2);
+            assert(l);
+            assert(strb_len(l) == STRB_INTERN_CHUNK_SIZE * 2);
+            assert(!memcmp(strb_cptr(l), big, STRB_INTERN_CHUNK_SIZE * 2));
+            assert(strb_intern(table, big, STRB_INTERN_CHUNK_SIZE * 2) == l);
+            assert(strb_intern(table, "after", 5));
+            assert(strb_intern(table, "alpha", 5) == a);
+            free(big);
+        }
+#endif
+        strb_intern_free(table);
+        strb_intern_free(table2);
+        strb_intern_free(NULL);
+
+#if STRB_STATIC_ALLOC
+        {
+            _Optional strbintern_t *pool[STRB_INTERN_TABLES];
+
+            for (i = 0; i < STRB_INTERN_TABLES; ++i) {
+                pool[i] = strb_intern_alloc();
+                assert(pool[i]);
+            }
+            assert(!strb_intern_alloc()); // pool exhausted
+            for (i = 0; i < STRB_INTERN_TABLES; ++i)
+                strb_intern_free(pool[i]);
+        }
+#endif
+    }
+#endif
+
+#if STRB_LARGE
+    {
+        const size_t big = (size_t)UINT16_MAX * 64; // several megabytes
+
+        s = strb_alloc(0);
+        assert(strb_nputc(s, 'x', big) == 'x');
+        assert(strb_len(s) == big);
+        assert(strb_tell(s) == big);
+        assert(strb_ptr(s)[big] == '\0');
+
+        assert(!strb_putf(s, "%s%d", "END", 99));
+        assert(strb_len(s) == big + strlen("END99"));
+        assert(!strcmp(strb_ptr(s) + big, "END99"));
+
+        assert(!strb_seek(s, UINT16_MAX));
+        assert(!strb_puts(s, "MID"));
+        assert(strb_tell(s) == (size_t)UINT16_MAX + strlen("MID"));
+        assert(strb_len(s) == big + strlen("END99MID"));
+        assert(!strncmp(strb_ptr(s) + UINT16_MAX - 1, "xMIDx", 5));
+
+        assert(!strb_seek(s, big * 2));
+        assert(strb_putc(s, 'y') == 'y');
+        assert(strb_len(s) == big * 2 + 1);
+        assert(strb_ptr(s)[big * 2 - 1] == '\0');
+        assert(!strcmp(strb_ptr(s) + big * 2, "y"));
+
+        strb_delto(s, UINT16_MAX);
+        assert(strb_tell(s) == UINT16_MAX);
+        assert(strb_len(s) == UINT16_MAX);
+        assert(strb_ptr(s)[strb_len(s)] == '\0');
+
+        assert(strb_seek(s, SIZE_MAX) == EOF);
+        assert(strb_error(s));
+        strb_clearerr(s);
+        assert(strb_write(s, SIZE_MAX - UINT16_MAX) == NULL);
+        assert(strb_error(s));
+        assert(strb_len(s) == UINT16_MAX);
+        strb_free(s);
+
+        s = strb_alloc(big);
+        test(s);
+        strb_free(s);
+    }
+
+#if STRB_MMAP
+    {
+        const size_t huge = STRB_MMAP_THRESHOLD + 1;
+
+        s = strb_dup("map");
+        assert(!strb_reserve(s, huge)); // copied into a mapped buffer
+        assert(!strcmp(strb_ptr(s), "map"));
+        assert(strb_nputc(s, 'm', huge * 2) == 'm'); // grown by remapping
+        assert(!strb_puts(s, "END"));
+        assert(strb_len(s) == huge * 2 + strlen("mapEND"));
+        assert(!strcmp(strb_ptr(s) + huge * 2 + 2, "mEND"));
+
+        strb_delto(s, huge);
+        strb_shrink_to_fit(s); // remapped in place
+        assert(strb_len(s) == huge);
+        assert(strb_ptr(s)[huge - 1] == 'm');
+
+        strb_delto(s, 3);
+        strb_shrink_to_fit(s); // copied back to the heap
+        assert(!strcmp(strb_ptr(s), "map"));
+        assert(!strb_puts(s, "ped"));
+        assert(!strcmp(strb_ptr(s), "mapped"));
+        strb_free(s);
+
+        s = strb_alloc(huge);
+        assert(!strb_puts(s, "mapped"));
+        assert(!strcmp(strb_ptr(s), "mapped"));
+        {
+            _Optional char *d = strb_detach(s, NULL); // copied from the mapping
+            assert(d);
+            assert(!strcmp(d, "mapped"));
+            free(d);
+
+            d = malloc(huge);
+            assert(d);
+            strcpy(d, "mapped");
+            s = strb_adopt(d, huge, 6); // size understated
+            assert(s);
+            assert(!strb_puts(s, " again"));
+            assert(!strcmp(strb_ptr(s), "mapped again"));
+            strb_free(s);
+
+            d = malloc(huge);
+            assert(d);
+            memset(d, 'h', huge - 1);
+            d[huge - 1] = '\0';
+            s = strb_adopt(d, huge, huge - 1); // moved into a mapping
+            assert(s);
+            assert(strb_len(s) == huge - 1);
+            assert(strb_ptr(s)[huge - 2] == 'h');
+            strb_free(s);
+        }
+    }
+#endif
+#endif // STRB_LARGE
+
+#if STRB_STATS
+    {
+        strbstats_t st, total;
+
+        s = strb_alloc(0);
+        strb_getstats(s, &st);
+        assert(!st.reallocs && !st.moved && !st.zeroed && !st.formats);
+
+        assert(!strb_puts(s, "middle"));
+        strb_getstats(s, &st);
+        assert(!st.moved);
+#if !STRB_STATIC_ALLOC
+        assert(strb_nputc(s, '.', 1000) == '.');
+        strb_getstats(s, &st);
+        assert(st.reallocs > 0);
+#endif
+
+        assert(!strb_seek(s, 0));
+        assert(!strb_puts(s, "in the "));
+        strb_getstats(s, &st);
+        assert(st.moved >= strlen("middle"));
+
+        assert(!strb_seek(s, strb_len(s) + 10));
+        assert(strb_putc(s, '!') == '!');
+        strb_getstats(s, &st);
+        assert(st.zeroed >= 10);
+
+        assert(!strb_putf(s, "%d", 42));
+        strb_getstats(s, &st);
+        assert(st.formats > 0);
+
+#if STRB_POSIX && !STRB_STATIC_ALLOC
+        {
+            // A regular file is read into a buffer sized once, without growing it at the end
+            char path[] = "/tmp/strbtestXXXXXX";
+            const int fd = mkstemp(path);
+            strb_t *const t = strb_alloc(0);
+            char block[1000];
+            int i;
+
+            assert(fd >= 0);
+            assert(t);
+            memset(block, 'r', sizeof block);
+            for (i = 0; i < 20; ++i)
+                assert(write(fd, block, sizeof block) == (ssize_t)sizeof block);
+            close(fd);
+
+            assert(!strb_readfile(t, path));
+            assert(strb_len(t) == 20 * sizeof block);
+            strb_getstats(t, &st);
+            assert(st.reallocs == 1);
+            strb_free(t);
+            unlink(path);
+        }
+#endif
+
+        strb_gettotalstats(&total);
+        assert(total.reallocs >= st.reallocs);
+        assert(total.moved >= st.moved);
+        assert(total.zeroed >= st.zeroed);
+        assert(total.formats >= st.formats);
+        strb_free(s);
+    }
+#endif
+
 #endif // !STRB_FREESTANDING
     return 0;
 }